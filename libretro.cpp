@@ -3,11 +3,18 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <float.h>
 #include "midi.hpp"
 #include <sndfile.h>
 #include <mutex>
 #include <atomic>
+#include <thread>
 #include <vector>
+#include <string>
+#include <algorithm>
+#include <stdexcept>
+#include <iterator>
+#include <stddef.h>
 
 #include "vulkan/vulkan_symbol_wrapper.h"
 #include <libretro_vulkan.h>
@@ -26,7 +33,19 @@ static std::atomic_uint audio_frames;
 #define BASE_HEIGHT 720
 #define MAX_SYNC 8
 
-#define NUM_PARTICLES (64 * 1024)
+#define DEFAULT_PARTICLES (64 * 1024)
+
+// Matches the layouts in shaders/compute.inc.
+enum ParticleLayout
+{
+   LAYOUT_SPLIT,
+   LAYOUT_INTERLEAVED,
+   LAYOUT_QUANTIZED,
+   NUM_LAYOUTS
+};
+#define NUM_PARTICLE_BUFFERS 3
+#define POSITION_RANGE 2.0f
+#define MAX_EMIT_REQUESTS 4096
 #define FRAMES (44100 / 60)
 
 static unsigned width  = BASE_WIDTH;
@@ -52,14 +71,45 @@ struct vulkan_data
    uint32_t swapchain_mask;
 
    buffer vbo;
-   buffer positions;
-   buffer velocity;
-   buffer color;
-   unsigned particle_ptr;
+
+   // Particle budget, a power of two. Every buffer below that holds particles is sized for it.
+   unsigned num_particles;
+
+   // Positions, velocities and colors with the split layout. The other layouts keep
+   // whole particles in the first buffer and leave the others empty.
+   ParticleLayout layout;
+   buffer particles[NUM_PARTICLE_BUFFERS];
+
+   // MAX_EMIT_REQUESTS emitter requests for every sync index, persistently mapped.
+   buffer requests;
+   void *requests_ptr;
+
+   // Note-ons of the whole song, uploaded once the bake is done, and the indirect
+   // dispatches locate.comp derives from them every update.
+   buffer song_events;
+   bool song_events_uploaded;
+   buffer dispatches;
+
+   // Slots of dead particles, see FreeList in shaders/emit.inc.
+   buffer free_list;
+
+   // Indexed indirect draw of the live particles, see DrawList in shaders/emit.inc.
+   buffer draw_list;
+
+   // Noise of move.comp evaluated on a flow_size by flow_size grid every update.
+   // With a flow_size of 0 move.comp evaluates it per particle, and the image is a single texel.
+   unsigned flow_size;
+   VkImage flow_image;
+   VkDeviceMemory flow_memory;
+   VkImageView flow_view;
+   VkSampler flow_sampler;
 
    VkPhysicalDeviceMemoryProperties memory_properties;
    VkPhysicalDeviceProperties gpu_properties;
 
+   // Workgroup size of the particle shaders, specialized into every compute pipeline.
+   unsigned group_size;
+
    VkDescriptorSetLayout set_layout;
    VkDescriptorPool desc_pool;
    VkDescriptorSet desc_set;
@@ -71,14 +121,12 @@ struct vulkan_data
 
    VkPipeline particle_pipeline;
    VkPipeline generate_pipeline;
+   VkPipeline locate_pipeline;
    VkPipeline move_pipeline;
-   VkPipeline pluck_pipeline;
+   VkPipeline emit_pipeline;
+   VkPipeline flow_pipeline;
    VkPipeline kick_pipeline;
    VkPipeline snare_pipeline;
-   VkPipeline arp_pipeline;
-   VkPipeline bass_pipeline;
-   VkPipeline lead_pipeline;
-   VkPipeline piano_pipeline;
 
    struct retro_vulkan_image images[MAX_SYNC];
    VkDeviceMemory image_memory[MAX_SYNC];
@@ -88,7 +136,8 @@ struct vulkan_data
 };
 static struct vulkan_data vk;
 
-struct particle_state
+// The part of particle_state which only depends on the song, as it is after a given frame.
+struct frame_state
 {
    float r = 0.0f;
    float g = 0.0f;
@@ -98,28 +147,30 @@ struct particle_state
    float kick_beat = 0.0f;
    float snare_beat = 0.0f;
 
+   // Controller values of the frame being processed, fed to the move and emitter shaders.
+   float modulation = 0.0f;
+   float brightness = 1.0f;
+   float bend = 0.0f;
+};
+
+struct particle_state : frame_state
+{
    double frame;
-   double last_lead[128];
-   bool lead[128];
-   float lead_velocity[128];
-   double last_bass[128];
-   bool bass[128];
-   float bass_velocity[128];
+
+   // Scratch space for the held lead and bass notes of a frame.
+   std::vector<MIDI::Note> held_notes;
 
    unsigned end_counter;
    bool left, right;
 };
 static particle_state state;
 
-static void reset_state()
-{
-   memset(state.lead, 0, sizeof(state.lead));
-   memset(state.last_lead, 0, sizeof(state.last_lead));
-   memset(state.lead_velocity, 0, sizeof(state.lead_velocity));
-   memset(state.bass, 0, sizeof(state.bass));
-   memset(state.last_bass, 0, sizeof(state.last_bass));
-   memset(state.bass_velocity, 0, sizeof(state.bass_velocity));
-}
+// frame_state of every frame of the song, baked on a worker thread after loading.
+// Until it is done, and past the end of the song, the state is advanced frame by frame instead.
+static std::vector<frame_state> baked_states;
+static std::atomic_bool baked_ready;
+static std::atomic_bool bake_cancel;
+static std::thread bake_thread;
 
 void retro_init(void)
 {}
@@ -172,6 +223,23 @@ void retro_set_environment(retro_environment_t cb)
 
    bool no_rom = true;
    cb(RETRO_ENVIRONMENT_SET_SUPPORT_NO_GAME, &no_rom);
+
+   static const struct retro_variable vars[] = {
+      { "midiviz_streaming", "Stream MIDI events during playback (for huge files); disabled|enabled" },
+      { "midiviz_autotune", "Time compute workgroup sizes on first run; disabled|enabled" },
+      { "midiviz_particles", "Particle budget (capped by video memory); 65536|131072|262144|524288|1048576|2097152|4194304|8388608|16777216" },
+      { "midiviz_layout", "Particle memory layout; split|interleaved|quantized" },
+      { "midiviz_benchmark", "Time every particle layout on startup; disabled|enabled" },
+      { "midiviz_flow_field", "Sample the flow noise from a grid of up to this size (capped by the particle budget); disabled|256|512|1024" },
+      { nullptr, nullptr },
+   };
+   cb(RETRO_ENVIRONMENT_SET_VARIABLES, (void*)vars);
+}
+
+static bool get_option_enabled(const char *key)
+{
+   struct retro_variable var = { key, nullptr };
+   return environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value && !strcmp(var.value, "enabled");
 }
 
 void retro_set_audio_sample(retro_audio_sample_t cb)
@@ -234,26 +302,151 @@ static void pipeline_barrier(VkCommandBuffer cmd,
          1, &barrier, 0, nullptr, 0, nullptr);
 }
 
-struct BaseGenerate
+// Matches Request in shaders/emit.inc. Emitters without a phase ignore it.
+struct EmitRequest
 {
+   float key;
+   float vel;
+   float phase;
+   float brightness;
+};
+
+enum Emitter
+{
+   EMIT_PLUCK,
+   EMIT_ARP,
+   EMIT_PIANO,
+   EMIT_LEAD,
+   EMIT_BASS,
+   NUM_EMITTERS
+};
+
+// Particles per request. The shape of every burst is in the instrument table in shaders/emit.comp.
+static const unsigned emitter_particles[NUM_EMITTERS] = {
+   256, // EMIT_PLUCK
+   512, // EMIT_ARP
+   256, // EMIT_PIANO
+   128, // EMIT_LEAD
+   256, // EMIT_BASS
+};
+
+// Matches SongEvent in shaders/emit.inc.
+struct SongEvent
+{
+   uint32_t frame;
+   EmitRequest request;
+};
+
+// Matches Dispatches in shaders/emit.inc.
+struct EmitDispatch
+{
+   VkDispatchIndirectCommand groups;
    uint32_t base;
-   uint32_t mask;
+   uint32_t allocated;
+   struct
+   {
+      uint32_t first_event;
+      uint32_t num_events;
+      uint32_t first_group;
+   } emitters[NUM_EMITTERS];
+};
+#define DISPATCHES_SIZE sizeof(EmitDispatch)
+
+static const struct
+{
+   const char *name;
+   // Bytes a particle takes in each of vk.particles.
+   uint32_t sizes[NUM_PARTICLE_BUFFERS];
+   // Bytes the particle pass fetches for a particle.
+   uint32_t drawn_size;
+} particle_layouts[NUM_LAYOUTS] = {
+   { "split", { 8, 4, 8 }, 16 },        // vec2, half2 and half4 in buffers of their own.
+   { "interleaved", { 20, 0, 0 }, 16 }, // The same, back to back.
+   { "quantized", { 16, 0, 0 }, 12 },   // Fixed point position, half2, half4.
 };
 
-static void generate_particles(VkCommandBuffer cmd, VkPipeline pipeline, unsigned count, BaseGenerate &base, size_t size)
+#define PARTICLE_BUFFER_SIZE(i, count) (VkDeviceSize(count) * particle_layouts[vk.layout].sizes[i])
+
+// FreeList in shaders/emit.inc: head, tail and a slot for every particle.
+#define FREE_LIST_SIZE(count) ((2 + VkDeviceSize(count)) * sizeof(uint32_t))
+
+// DrawList in shaders/emit.inc: the draw command followed by the index of every live particle.
+#define DRAW_LIST_INDICES sizeof(VkDrawIndexedIndirectCommand)
+#define DRAW_LIST_SIZE(count) (DRAW_LIST_INDICES + VkDeviceSize(count) * sizeof(uint32_t))
+
+// Requests the CPU still makes, gathered over all frames of an update.
+static std::vector<EmitRequest> emit_requests[NUM_EMITTERS];
+
+// Song events of every emitter, baked along with the frame states.
+// The events of emitter i are baked_event_begin[i] up to baked_event_begin[i + 1].
+static std::vector<SongEvent> baked_events;
+static uint32_t baked_event_begin[NUM_EMITTERS + 1];
+
+// Emits the particles of frames [from_frame, to_frame) with one dispatch. The GPU picks the song's note-ons
+// out of the uploaded events itself, so the CPU only records what it gathered on top.
+static void flush_emitters(VkCommandBuffer cmd, unsigned from_frame, unsigned to_frame)
 {
-   vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+   struct LocatePush
+   {
+      uint32_t from_frame;
+      uint32_t to_frame;
+      uint32_t begin[NUM_EMITTERS + 1];
+      uint32_t requests[NUM_EMITTERS];
+      uint32_t groups_per_request[NUM_EMITTERS];
+   };
 
-   base.base = vk.particle_ptr;
-   base.mask = NUM_PARTICLES - 1u;
+   struct EmitPush
+   {
+      uint32_t base;
+      uint32_t first_request[NUM_EMITTERS];
+      uint32_t groups_per_request[NUM_EMITTERS];
+   };
+
+   auto *requests = static_cast<EmitRequest *>(vk.requests_ptr) + vk.index * MAX_EMIT_REQUESTS;
+   unsigned num_requests = 0;
+
+   LocatePush locate = {};
+   locate.from_frame = from_frame;
+   locate.to_frame = to_frame;
+   if (vk.song_events_uploaded)
+      memcpy(locate.begin, baked_event_begin, sizeof(locate.begin));
+
+   EmitPush emit = {};
+
+   for (unsigned i = 0; i < NUM_EMITTERS; i++)
+   {
+      auto &pending = emit_requests[i];
+      // Anything beyond the request buffer would overwrite particles of the same update anyway.
+      unsigned count = std::min(unsigned(pending.size()), MAX_EMIT_REQUESTS - num_requests);
+      memcpy(requests + num_requests, pending.data(), count * sizeof(EmitRequest));
+      pending.clear();
+
+      emit.first_request[i] = vk.index * MAX_EMIT_REQUESTS + num_requests;
+      emit.groups_per_request[i] = emitter_particles[i] / vk.group_size;
+      locate.requests[i] = count;
+      locate.groups_per_request[i] = emit.groups_per_request[i];
+      num_requests += count;
+   }
 
    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE,
          vk.compute_pipeline_layout, 0, 1, &vk.desc_set, 0, nullptr);
+
+   vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, vk.locate_pipeline);
    vkCmdPushConstants(cmd, vk.compute_pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT,
-         0, size, &base);
-   vkCmdDispatch(cmd, count / 64, 1, 1);
+         0, sizeof(locate), &locate);
+   vkCmdDispatch(cmd, 1, 1, 1);
 
-   vk.particle_ptr = (vk.particle_ptr + count) & (NUM_PARTICLES - 1);
+   pipeline_barrier(cmd,
+         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+         VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+         VK_ACCESS_SHADER_WRITE_BIT,
+         VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_SHADER_READ_BIT);
+
+   // Every instrument shares the one dispatch, so there are no pipeline switches.
+   vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, vk.emit_pipeline);
+   vkCmdPushConstants(cmd, vk.compute_pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT,
+         0, sizeof(emit), &emit);
+   vkCmdDispatchIndirect(cmd, vk.dispatches.buffer, 0);
 }
 
 static float fract(float v)
@@ -261,45 +454,106 @@ static float fract(float v)
    return v - floor(v);
 }
 
-static void move_particles(VkCommandBuffer cmd, float step_frames)
+struct MovePush
 {
-   pipeline_barrier(cmd,
-         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-         VK_ACCESS_SHADER_WRITE_BIT,
-         VK_ACCESS_SHADER_WRITE_BIT);
+   uint32_t base = 0;
+   float delta = 0.0f;
+   float frame = 0.0f;
+   float kick = 0.0f;
+   float kick_beat = 0.0f;
+   float snare = 0.0f;
+   float snare_beat = 0.0f;
+   float modulation = 0.0f;
+   float bend = 0.0f;
+   float bound_x = 0.0f;
+   float bound_y = 0.0f;
+};
 
-   vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, vk.move_pipeline);
-   vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE,
-         vk.compute_pipeline_layout, 0, 1, &vk.desc_set, 0, nullptr);
+// Particles this far past the edge of the screen can no longer be seen.
+#define SCREEN_MARGIN 0.05f
 
-   struct Push
+// Runs the bound pipeline once for every particle. Big budgets need more workgroups than a single
+// dispatch may have, so they are split up, and every part gets the base of its particles pushed.
+static void dispatch_particles(VkCommandBuffer cmd, MovePush push, unsigned group_size)
+{
+   uint32_t max_groups = vk.gpu_properties.limits.maxComputeWorkGroupCount[0];
+   uint32_t groups = vk.num_particles / group_size;
+   for (uint32_t first = 0; first < groups; first += max_groups)
    {
-      uint32_t base = 0;
-      uint32_t mask = ~0u;
-      float delta;
-      float frame;
-      float kick;
-      float kick_beat;
-      float snare;
-      float snare_beat;
-   };
+      push.base = first * group_size;
+      vkCmdPushConstants(cmd, vk.compute_pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT,
+            0, sizeof(push), &push);
+      vkCmdDispatch(cmd, std::min(max_groups, groups - first), 1, 1);
+   }
+}
+
+// Evaluates the noise for the next move pass on the flow field grid, if there is one.
+// Only move.comp reads the field, so the barrier in front of it covers this as well.
+static void update_flow_field(VkCommandBuffer cmd, float period)
+{
+   if (!vk.flow_size)
+      return;
 
+   vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, vk.flow_pipeline);
+   vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE,
+         vk.compute_pipeline_layout, 0, 1, &vk.desc_set, 0, nullptr);
+   vkCmdPushConstants(cmd, vk.compute_pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT,
+         0, sizeof(period), &period);
+   vkCmdDispatch(cmd, vk.flow_size / 8, vk.flow_size / 8, 1);
+}
+
+static void move_particles(VkCommandBuffer cmd, float step_frames)
+{
    float beat = midi_file.get_beat();
 
-   Push push;
+   MovePush push;
    push.delta = step_frames / 60.0f;
    push.frame = 2.0 * fract(0.25 * beat);
    push.kick = state.kick;
    push.kick_beat = 1.0f - (beat - state.kick_beat);
    push.snare = state.snare;
    push.snare_beat = beat - state.snare_beat;
+   push.modulation = state.modulation;
+   push.bend = state.bend;
+   push.bound_x = float(width) / height + SCREEN_MARGIN;
+   push.bound_y = 1.0f + SCREEN_MARGIN;
    if (push.frame > 1.0)
       push.frame = 2.0 - push.frame;
 
-   vkCmdPushConstants(cmd, vk.compute_pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT,
-         0, sizeof(push), &push);
-   vkCmdDispatch(cmd, NUM_PARTICLES / 64, 1, 1);
+   update_flow_field(cmd, push.frame);
+
+   pipeline_barrier(cmd,
+         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+         VK_ACCESS_SHADER_WRITE_BIT,
+         VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+
+   vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, vk.move_pipeline);
+   vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE,
+         vk.compute_pipeline_layout, 0, 1, &vk.desc_set, 0, nullptr);
+   dispatch_particles(cmd, push, vk.group_size);
+}
+
+// Strongest modulation, filter cutoff and pitch bend over all channels.
+static void sample_controls(frame_state &s, MIDI::File &file, unsigned frame)
+{
+   float modulation = 0.0f;
+   float cutoff = -1.0f;
+   float bend = 0.0f;
+   for (unsigned channel = 0; channel < 16; channel++)
+   {
+      modulation = std::max(modulation, file.get_control(channel, MIDI::ControlModulation, frame));
+      cutoff = std::max(cutoff, file.get_control(channel, MIDI::ControlCutoff, frame, -1.0f));
+
+      float channel_bend = file.get_control(channel, MIDI::ControlPitchBend, frame);
+      if (fabsf(channel_bend) > fabsf(bend))
+         bend = channel_bend;
+   }
+
+   s.modulation = modulation;
+   s.bend = bend;
+   // Songs without cutoff automation keep the original colors.
+   s.brightness = cutoff >= 0.0f ? 0.5f + cutoff : 1.0f;
 }
 
 enum Tracks
@@ -313,188 +567,275 @@ enum Tracks
    PIANO = 8,
 };
 
-static void vulkan_update_particles(VkCommandBuffer cmd)
+// Tracks whose note-ons spawn a burst of particles.
+static const struct
 {
-   double current_audio_frame = double(audio_frames.load(std::memory_order_relaxed)) / FRAMES;
-   double diff_frames = current_audio_frame - state.frame - 1.0;
-   double step_frames = 1.0 + 0.01 * diff_frames;
+   unsigned track;
+   Emitter emitter;
+} note_on_emitters[] = {
+   { PLUCKS, EMIT_PLUCK },
+   { BAND_PASS_TRANCE, EMIT_ARP },
+   { PIANO, EMIT_PIANO },
+};
 
-   unsigned last_frame = unsigned(state.frame);
-   state.frame += step_frames;
-   unsigned current_frame = unsigned(state.frame);
+template <typename Func>
+static void for_each_note_on(const MIDI::FrameEvents &events, float brightness, Func func)
+{
+   for (auto &emitter : note_on_emitters)
+      for (auto &e : events.get_events(emitter.track))
+         if (e.kon && e.velocity)
+            func(emitter.emitter, EmitRequest{ float(e.note), float(e.velocity) * (1.0f / 127.0f), 0.0f, brightness });
+}
 
-   for (unsigned i = last_frame; i < current_frame; i++)
-   {
-      midi_file.step();
+// Applies the events of a frame to s and lets the flashes decay.
+// file must be positioned right after the frame.
+static void advance_state(frame_state &s, MIDI::File &file, const MIDI::FrameEvents &events, unsigned frame)
+{
+   // Beat as seen right after stepping this frame.
+   double beat = file.get_beat(frame + 1);
+   sample_controls(s, file, frame);
 
-      for (auto &e : midi_file.get_events(GATED))
+   for (auto &e : events.get_events(GATED))
+   {
+      if (e.kon && e.velocity)
       {
-         if (e.kon && e.velocity)
-         {
-            state.r += 0.1f;
-            state.g += 0.0f;
-            state.b += 0.1f;
-         }
+         s.r += 0.1f;
+         s.g += 0.0f;
+         s.b += 0.1f;
       }
+   }
 
-      for (auto &e : midi_file.get_events(DRUMS))
+   for (auto &e : events.get_events(DRUMS))
+   {
+      if (e.kon && e.velocity)
       {
-         if (e.kon && e.velocity)
+         if (e.note == 36) // C1: Kick
          {
-            if (e.note == 36) // C1: Kick
-            {
-               state.kick_beat = midi_file.get_beat();
-               state.kick += 1.0f;
-            }
-            else if (e.note == 37) // C#1: Snare
-            {
-               state.snare_beat = midi_file.get_beat();
-               state.snare += 1.0f;
-            }
-            else
-               state.g += 0.10f;
+            s.kick_beat = beat;
+            s.kick += 1.0f;
          }
-      }
-
-      state.kick -= state.kick * 0.05f;
-      state.snare -= state.snare * 0.025f;
-
-      for (auto &e : midi_file.get_events(LEAD))
-      {
-         if (e.kon && e.velocity)
+         else if (e.note == 37) // C#1: Snare
          {
-            state.lead[e.note] = true;
-            state.last_lead[e.note] = state.frame;
-            state.lead_velocity[e.note] = e.velocity * (1.0f / 127.0f);
+            s.snare_beat = beat;
+            s.snare += 1.0f;
          }
-         else if (!e.kon || !e.velocity)
-            state.lead[e.note] = false;
+         else
+            s.g += 0.10f;
       }
+   }
+
+   s.kick -= s.kick * 0.05f;
+   s.snare -= s.snare * 0.025f;
 
-      for (auto &e : midi_file.get_events(BASS))
+   s.r -= s.r * 0.06f;
+   s.g -= s.g * 0.07f;
+   s.b -= s.b * 0.08f;
+}
+
+// Plays the whole song through its own File, recording the state after every frame.
+static void bake_states(MIDI::File file)
+{
+   std::vector<frame_state> states;
+   std::vector<SongEvent> events_by_emitter[NUM_EMITTERS];
+   frame_state s;
+   unsigned frame = 0;
+
+   while (!file.eof())
+   {
+      if (bake_cancel.load(std::memory_order_relaxed))
+         return;
+
+      const unsigned count = 1024;
+      auto &frames = file.step(count);
+      size_t next_events = 0;
+      for (unsigned i = 0; i < count; i++, frame++)
       {
-         if (e.kon && e.velocity)
-         {
-            state.bass[e.note] = true;
-            state.last_bass[e.note] = state.frame;
-            state.bass_velocity[e.note] = e.velocity * (1.0f / 127.0f);
-         }
-         else if (!e.kon || !e.velocity)
-            state.bass[e.note] = false;
+         MIDI::FrameEvents events;
+         if (next_events < frames.size() && frames[next_events].get_frame() == frame)
+            events = frames[next_events++];
+
+         advance_state(s, file, events, frame);
+         states.push_back(s);
+
+         for_each_note_on(events, s.brightness, [&](Emitter emitter, const EmitRequest &request) {
+            events_by_emitter[emitter].push_back({ frame, request });
+         });
       }
+   }
 
-      state.r -= state.r * 0.06f;
-      state.g -= state.g * 0.07f;
-      state.b -= state.b * 0.08f;
+   baked_events.clear();
+   for (unsigned i = 0; i < NUM_EMITTERS; i++)
+   {
+      baked_event_begin[i] = baked_events.size();
+      baked_events.insert(baked_events.end(), events_by_emitter[i].begin(), events_by_emitter[i].end());
+   }
+   baked_event_begin[NUM_EMITTERS] = baked_events.size();
+
+   baked_states = std::move(states);
+   baked_ready.store(true, std::memory_order_release);
+}
 
-      // All compute stuff here.
-      if (i == last_frame)
+static void start_bake(MIDI::File file)
+{
+   baked_ready.store(false);
+   bake_cancel.store(false);
+   bake_thread = std::thread([](MIDI::File file) {
+      try
       {
-         pipeline_barrier(cmd,
-               VK_PIPELINE_STAGE_VERTEX_SHADER_BIT,
-               VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-               0,
-               0);
+         bake_states(std::move(file));
       }
-
-      // Generate pluck particles.
-      for (auto &e : midi_file.get_events(PLUCKS))
+      catch (const std::exception &e)
       {
-         struct Pluck : BaseGenerate
-         {
-            float key;
-            float vel;
-         };
-
-         if (e.kon && e.velocity)
-         {
-            Pluck gen;
-            gen.key = float(e.note);
-            gen.vel = float(e.velocity) * (1.0f / 127.0f);
-            generate_particles(cmd, vk.pluck_pipeline, 256, gen, sizeof(gen));
-         }
+         fprintf(stderr, "Failed to bake frame states: %s\n", e.what());
       }
+   }, std::move(file));
+}
 
-      // Generate arp particles.
-      for (auto &e : midi_file.get_events(BAND_PASS_TRANCE))
-      {
-         struct BandPass : BaseGenerate
-         {
-            float key;
-            float vel;
-         };
+static void stop_bake()
+{
+   bake_cancel.store(true);
+   if (bake_thread.joinable())
+      bake_thread.join();
+   baked_ready.store(false);
+   baked_states.clear();
+   baked_events.clear();
+   vk.song_events_uploaded = false;
+}
 
-         if (e.kon && e.velocity)
-         {
-            BandPass gen;
-            gen.key = float(e.note);
-            gen.vel = float(e.velocity) * (1.0f / 127.0f);
-            generate_particles(cmd, vk.arp_pipeline, 512, gen, sizeof(gen));
-         }
-      }
+static void vulkan_update_particles(VkCommandBuffer cmd)
+{
+   double current_audio_frame = double(audio_frames.load(std::memory_order_relaxed)) / FRAMES;
+   double diff_frames = current_audio_frame - state.frame - 1.0;
+   double step_frames = 1.0 + 0.01 * diff_frames;
 
-      for (auto &e : midi_file.get_events(PIANO))
-      {
-         struct Piano : BaseGenerate
-         {
-            float key;
-            float vel;
-         };
+   unsigned last_frame = unsigned(state.frame);
+   state.frame += step_frames;
+   unsigned current_frame = unsigned(state.frame);
 
-         if (e.kon && e.velocity)
-         {
-            Piano gen;
-            gen.key = float(e.note);
-            gen.vel = float(e.velocity) * (1.0f / 127.0f);
-            generate_particles(cmd, vk.piano_pipeline, 256, gen, sizeof(gen));
-         }
+   // Catch up on every frame in one pass over the timeline.
+   unsigned midi_frame = midi_file.get_frame();
+   unsigned first_midi_frame = midi_frame;
+   auto &frames = midi_file.step(current_frame - last_frame);
+   size_t next_events = 0;
+   bool baked = baked_ready.load(std::memory_order_acquire);
+
+   for (unsigned i = last_frame; i < current_frame; i++, midi_frame++)
+   {
+      MIDI::FrameEvents events;
+      if (next_events < frames.size() && frames[next_events].get_frame() == midi_frame)
+         events = frames[next_events++];
+
+      // The baked table also gives the exact state right after a seek.
+      if (baked && midi_frame < baked_states.size())
+         static_cast<frame_state &>(state) = baked_states[midi_frame];
+      else
+         advance_state(state, midi_file, events, midi_frame);
+
+      double beat = midi_file.get_beat(midi_frame + 1);
+
+      // Once the song's note-ons live on the GPU, it finds them there by itself.
+      if (!vk.song_events_uploaded)
+      {
+         for_each_note_on(events, state.brightness, [](Emitter emitter, const EmitRequest &request) {
+            emit_requests[emitter].push_back(request);
+         });
       }
 
-      float beat_phase = 2.0f * fract(0.25f * midi_file.get_beat());
+      float beat_phase = 2.0f * fract(0.25f * beat);
       if (beat_phase > 1.0f)
          beat_phase = 2.0f - beat_phase;
       beat_phase = (beat_phase - 0.5f) * 2.0f;
 
-      for (unsigned i = 0; i < 128; i++)
+      // Held notes come straight from the note index, so they survive seeking.
+      state.held_notes.clear();
+      midi_file.get_active_notes(LEAD, midi_frame, state.held_notes);
+      for (auto &note : state.held_notes)
       {
-         struct Lead : BaseGenerate
-         {
-            float key;
-            float vel;
-            float phase;
-         };
-
-         if (state.lead[i])
-         {
-            Lead gen;
-            gen.key = float(i);
-
-            unsigned t = state.frame - state.last_lead[i];
-            gen.vel = float(state.lead_velocity[i]) * exp2(float(t) * -0.005f);
-            gen.phase = beat_phase;
-            generate_particles(cmd, vk.lead_pipeline, 128, gen, sizeof(gen));
-         }
-
-         if (state.bass[i])
-         {
-            Lead gen;
-            gen.key = float(i);
+         unsigned t = midi_frame - note.start;
+         emit_requests[EMIT_LEAD].push_back({ float(note.note),
+               note.velocity * (1.0f / 127.0f) * exp2(float(t) * -0.005f), beat_phase, state.brightness });
+      }
 
-            unsigned t = state.frame - state.last_bass[i];
-            gen.vel = float(state.bass_velocity[i]) * exp2(float(t) * -0.08f);
-            gen.phase = beat_phase;
-            generate_particles(cmd, vk.bass_pipeline, 256, gen, sizeof(gen));
-         }
+      state.held_notes.clear();
+      midi_file.get_active_notes(BASS, midi_frame, state.held_notes);
+      for (auto &note : state.held_notes)
+      {
+         unsigned t = midi_frame - note.start;
+         emit_requests[EMIT_BASS].push_back({ float(note.note),
+               note.velocity * (1.0f / 127.0f) * exp2(float(t) * -0.08f), beat_phase, state.brightness });
       }
    }
 
+   // All compute stuff here.
+   pipeline_barrier(cmd,
+         VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+         0,
+         0);
+
+   flush_emitters(cmd, first_midi_frame, midi_frame);
    move_particles(cmd, step_frames);
 
+   // The slots move.comp freed are handed out by the next update.
    pipeline_barrier(cmd,
          VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-         VK_PIPELINE_STAGE_VERTEX_SHADER_BIT,
+         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+         VK_ACCESS_SHADER_WRITE_BIT,
+         VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+
+   pipeline_barrier(cmd,
+         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+         VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
          VK_ACCESS_SHADER_WRITE_BIT,
-         VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT);
+         VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_INDEX_READ_BIT | VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT);
+}
+
+static void set_viewport(VkCommandBuffer cmd, unsigned width, unsigned height)
+{
+   VkViewport vp = { 0 };
+   vp.x = 0.0f;
+   vp.y = 0.0f;
+   vp.width = width;
+   vp.height = height;
+   vp.minDepth = 0.0f;
+   vp.maxDepth = 1.0f;
+   vkCmdSetViewport(cmd, 0, 1, &vp);
+
+   VkRect2D scissor;
+   memset(&scissor, 0, sizeof(scissor));
+   scissor.extent.width = width;
+   scissor.extent.height = height;
+   vkCmdSetScissor(cmd, 0, 1, &scissor);
+}
+
+// Draws the particles move.comp found alive and on screen. Must be inside the render pass.
+static void draw_particles(VkCommandBuffer cmd)
+{
+   VkDeviceSize offset = 0;
+   vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, vk.particle_pipeline);
+   set_viewport(cmd, width, height);
+   vkCmdBindVertexBuffers(cmd, 0, 1, &vk.particles[0].buffer, &offset);
+   if (vk.layout == LAYOUT_SPLIT)
+      vkCmdBindVertexBuffers(cmd, 1, 1, &vk.particles[2].buffer, &offset);
+   vkCmdBindIndexBuffer(cmd, vk.draw_list.buffer, DRAW_LIST_INDICES, VK_INDEX_TYPE_UINT32);
+
+   struct Push
+   {
+      float scale[2];
+      float point_scale;
+   };
+   Push push = { { float(height) / width, 1.0f }, float(BASE_WIDTH) / 640.0f };
+   if (vk.layout == LAYOUT_QUANTIZED)
+   {
+      // Positions come in as normalized fixed point.
+      push.scale[0] *= POSITION_RANGE;
+      push.scale[1] *= POSITION_RANGE;
+   }
+   vkCmdPushConstants(cmd, vk.pipeline_layout,
+         VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT,
+         0, sizeof(push), &push);
+
+   vkCmdDrawIndexedIndirect(cmd, vk.draw_list.buffer, 0, 1, sizeof(VkDrawIndexedIndirectCommand));
 }
 
 static void vulkan_render(void)
@@ -541,45 +882,10 @@ static void vulkan_render(void)
    rp_begin.pClearValues = &clear_value;
    vkCmdBeginRenderPass(cmd, &rp_begin, VK_SUBPASS_CONTENTS_INLINE);
 
-   auto set_viewport = [](VkCommandBuffer cmd, unsigned width, unsigned height) {
-      VkViewport vp = { 0 };
-      vp.x = 0.0f;
-      vp.y = 0.0f;
-      vp.width = width;
-      vp.height = height;
-      vp.minDepth = 0.0f;
-      vp.maxDepth = 1.0f;
-      vkCmdSetViewport(cmd, 0, 1, &vp);
-
-      VkRect2D scissor;
-      memset(&scissor, 0, sizeof(scissor));
-      scissor.extent.width = width;
-      scissor.extent.height = height;
-      vkCmdSetScissor(cmd, 0, 1, &scissor);
-   };
+   draw_particles(cmd);
 
    VkDeviceSize offset = 0;
 
-   // Particles
-   {
-      vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, vk.particle_pipeline);
-      set_viewport(cmd, width, height);
-      vkCmdBindVertexBuffers(cmd, 0, 1, &vk.positions.buffer, &offset);
-      vkCmdBindVertexBuffers(cmd, 1, 1, &vk.color.buffer, &offset);
-
-      struct Push
-      {
-         float scale[2];
-         float point_scale;
-      };
-      Push push = { { float(height) / width, 1.0f }, float(BASE_WIDTH) / 640.0f };
-      vkCmdPushConstants(cmd, vk.pipeline_layout,
-            VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT,
-            0, sizeof(push), &push);
-
-      vkCmdDraw(cmd, NUM_PARTICLES, 1, 0, 0);
-   }
-
    // Kick
    if (state.kick > 0.001f)
    {
@@ -672,7 +978,123 @@ static struct buffer create_buffer(const void *initial, size_t size, VkBufferUsa
       vkUnmapMemory(device, buffer.memory);
    }
 
-   return buffer;
+   return buffer;
+}
+
+// Bytes every particle takes with a layout: the particle itself, free slot and draw index.
+#define PARTICLE_SIZE(layout) (particle_layouts[layout].sizes[0] + particle_layouts[layout].sizes[1] + \
+      particle_layouts[layout].sizes[2] + 2 * sizeof(uint32_t))
+
+static ParticleLayout particle_layout(void)
+{
+   struct retro_variable var = { "midiviz_layout", nullptr };
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+      for (unsigned i = 0; i < NUM_LAYOUTS; i++)
+         if (!strcmp(var.value, particle_layouts[i].name))
+            return ParticleLayout(i);
+   return LAYOUT_SPLIT;
+}
+
+// The budget asked for in the core options, halved until the particles of the current layout fit in
+// half of the largest device local heap and every buffer in the storage buffer range of the device.
+static unsigned particle_budget(ParticleLayout layout)
+{
+   unsigned count = DEFAULT_PARTICLES;
+   struct retro_variable var = { "midiviz_particles", nullptr };
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+   {
+      unsigned requested = strtoul(var.value, nullptr, 0);
+      if (requested >= DEFAULT_PARTICLES && !(requested & (requested - 1)))
+         count = requested;
+   }
+
+   VkDeviceSize heap_size = 0;
+   for (uint32_t i = 0; i < vk.memory_properties.memoryHeapCount; i++)
+      if (vk.memory_properties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT)
+         heap_size = std::max(heap_size, vk.memory_properties.memoryHeaps[i].size);
+
+   VkDeviceSize max_range = vk.gpu_properties.limits.maxStorageBufferRange;
+   VkDeviceSize widest = std::max(particle_layouts[layout].sizes[0], particle_layouts[layout].sizes[2]);
+
+   // The draw list indexes every particle. The frontend creates the device, so fullDrawIndexUint32
+   // cannot be relied on, and without it indices stop at 2^24 - 1 whatever the limit says.
+   VkDeviceSize max_index = std::min<VkDeviceSize>(vk.gpu_properties.limits.maxDrawIndexedIndexValue, (1u << 24) - 1);
+
+   while (count > DEFAULT_PARTICLES &&
+         (count * PARTICLE_SIZE(layout) > heap_size / 2 || count * widest > max_range ||
+          DRAW_LIST_SIZE(count) > max_range || count - 1 > max_index))
+      count >>= 1;
+
+   return count;
+}
+
+// Fills every particle buffer there is with value.
+static void fill_particles(VkCommandBuffer cmd, uint32_t value)
+{
+   for (unsigned i = 0; i < NUM_PARTICLE_BUFFERS; i++)
+      if (vk.particles[i].buffer != VK_NULL_HANDLE)
+         vkCmdFillBuffer(cmd, vk.particles[i].buffer, 0, PARTICLE_BUFFER_SIZE(i, vk.num_particles), value);
+}
+
+// Creates the buffers of vk.num_particles particles, all of them dead and free.
+static void init_particle_buffers(void)
+{
+   unsigned count = vk.num_particles;
+   for (unsigned i = 0; i < NUM_PARTICLE_BUFFERS; i++)
+   {
+      if (particle_layouts[vk.layout].sizes[i])
+      {
+         vk.particles[i] = create_buffer(nullptr, PARTICLE_BUFFER_SIZE(i, count),
+               VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+               VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+      }
+   }
+
+   // Every slot starts out free.
+   std::vector<uint32_t> free_slots(2 + count);
+   free_slots[0] = 0;
+   free_slots[1] = count;
+   for (unsigned i = 0; i < count; i++)
+      free_slots[2 + i] = i;
+   buffer staging = create_buffer(free_slots.data(), FREE_LIST_SIZE(count), VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+         VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+   vk.free_list = create_buffer(nullptr, FREE_LIST_SIZE(count),
+         VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+         VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+   vk.draw_list = create_buffer(nullptr, DRAW_LIST_SIZE(count),
+         VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+         VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+         VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+   auto cmd = vk.cmd[0];
+   VkCommandBufferBeginInfo begin_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
+   begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+   vkResetCommandBuffer(cmd, 0);
+   vkBeginCommandBuffer(cmd, &begin_info);
+   VkBufferCopy region = { 0, 0, FREE_LIST_SIZE(count) };
+   vkCmdCopyBuffer(cmd, staging.buffer, vk.free_list.buffer, 1, &region);
+   fill_particles(cmd, 0);
+   vkCmdFillBuffer(cmd, vk.draw_list.buffer, 0, DRAW_LIST_INDICES, 0);
+   vkEndCommandBuffer(cmd);
+
+   VkSubmitInfo submit = { VK_STRUCTURE_TYPE_SUBMIT_INFO };
+   submit.commandBufferCount = 1;
+   submit.pCommandBuffers = &cmd;
+   vulkan->lock_queue(vulkan->handle);
+   vkQueueSubmit(vulkan->queue, 1, &submit, VK_NULL_HANDLE);
+   vulkan->unlock_queue(vulkan->handle);
+
+   vkQueueWaitIdle(vulkan->queue);
+   free_buffer(vulkan->device, &staging);
+}
+
+static void deinit_particle_buffers(void)
+{
+   VkDevice device = vulkan->device;
+   for (auto &particles : vk.particles)
+      free_buffer(device, &particles);
+   free_buffer(device, &vk.free_list);
+   free_buffer(device, &vk.draw_list);
 }
 
 static void init_buffers(void)
@@ -686,14 +1108,17 @@ static void init_buffers(void)
    vk.vbo = create_buffer(data, sizeof(data), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
          VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
 
-   vk.positions = create_buffer(nullptr, NUM_PARTICLES * 2 * sizeof(float),
-         VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
-         VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-   vk.velocity = create_buffer(nullptr, NUM_PARTICLES * 2 * sizeof(uint16_t),
-         VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+   vk.requests = create_buffer(nullptr, MAX_SYNC * MAX_EMIT_REQUESTS * sizeof(EmitRequest),
+         VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+         VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+   vkMapMemory(vulkan->device, vk.requests.memory, 0, VK_WHOLE_SIZE, 0, &vk.requests_ptr);
+
+   // Stays empty until upload_song_events() replaces it.
+   vk.song_events = create_buffer(nullptr, sizeof(SongEvent),
+         VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
          VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-   vk.color = create_buffer(nullptr, NUM_PARTICLES * 4 * sizeof(uint16_t),
-         VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+   vk.dispatches = create_buffer(nullptr, DISPATCHES_SIZE,
+         VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
          VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
 
    auto cmd = vk.cmd[0];
@@ -701,9 +1126,44 @@ static void init_buffers(void)
    begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
    vkResetCommandBuffer(cmd, 0);
    vkBeginCommandBuffer(cmd, &begin_info);
-   vkCmdFillBuffer(cmd, vk.positions.buffer, 0, NUM_PARTICLES * 2 * sizeof(float), 0);
-   vkCmdFillBuffer(cmd, vk.velocity.buffer, 0, NUM_PARTICLES * 2 * sizeof(uint16_t), 0);
-   vkCmdFillBuffer(cmd, vk.color.buffer, 0, NUM_PARTICLES * 4 * sizeof(uint16_t), 0);
+   vkCmdFillBuffer(cmd, vk.dispatches.buffer, 0, DISPATCHES_SIZE, 0);
+   vkEndCommandBuffer(cmd);
+
+   VkSubmitInfo submit = { VK_STRUCTURE_TYPE_SUBMIT_INFO };
+   submit.commandBufferCount = 1;
+   submit.pCommandBuffers = &cmd;
+   vulkan->lock_queue(vulkan->handle);
+   vkQueueSubmit(vulkan->queue, 1, &submit, VK_NULL_HANDLE);
+   vulkan->unlock_queue(vulkan->handle);
+
+   vkQueueWaitIdle(vulkan->queue);
+
+   init_particle_buffers();
+}
+
+// Copies the baked song events into a device-local buffer. Runs once per song and device,
+// before the command buffer of the frame is recorded, so it can wait for the copy.
+static void upload_song_events(void)
+{
+   VkDevice device = vulkan->device;
+   vk.song_events_uploaded = true;
+   if (baked_events.empty())
+      return;
+
+   size_t size = baked_events.size() * sizeof(SongEvent);
+   buffer staging = create_buffer(baked_events.data(), size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+         VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+   buffer events = create_buffer(nullptr, size,
+         VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+         VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+   auto cmd = vk.cmd[vk.index];
+   VkCommandBufferBeginInfo begin_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
+   begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+   vkResetCommandBuffer(cmd, 0);
+   vkBeginCommandBuffer(cmd, &begin_info);
+   VkBufferCopy region = { 0, 0, size };
+   vkCmdCopyBuffer(cmd, staging.buffer, events.buffer, 1, &region);
    vkEndCommandBuffer(cmd);
 
    VkSubmitInfo submit = { VK_STRUCTURE_TYPE_SUBMIT_INFO };
@@ -714,6 +1174,18 @@ static void init_buffers(void)
    vulkan->unlock_queue(vulkan->handle);
 
    vkQueueWaitIdle(vulkan->queue);
+   free_buffer(device, &staging);
+   free_buffer(device, &vk.song_events);
+   vk.song_events = events;
+
+   VkDescriptorBufferInfo buffer_info = { vk.song_events.buffer, 0, VK_WHOLE_SIZE };
+   VkWriteDescriptorSet write = { VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET };
+   write.dstSet = vk.desc_set;
+   write.dstBinding = 4;
+   write.descriptorCount = 1;
+   write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+   write.pBufferInfo = &buffer_info;
+   vkUpdateDescriptorSets(device, 1, &write, 0, nullptr);
 }
 
 static VkShaderModule create_shader_module(const uint32_t *data, size_t size)
@@ -726,27 +1198,212 @@ static VkShaderModule create_shader_module(const uint32_t *data, size_t size)
    return module;
 }
 
+// flow.comp evaluates the noise this many times per texel to low-pass it.
+#define FLOW_TAPS 4
+
+// Grid size from the core options, 0 when move.comp evaluates the noise itself.
+// The grid only pays off while it costs fewer noise evaluations than vk.num_particles, so a
+// requested size is halved down to 256 until it does, and gives way to the per particle noise after.
+static unsigned flow_field_size(void)
+{
+   struct retro_variable var = { "midiviz_flow_field", nullptr };
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+   {
+      unsigned size = strtoul(var.value, nullptr, 0);
+      if (size < 8 || size % 8)
+         return 0;
+
+      while (size > 256 && FLOW_TAPS * size * size > vk.num_particles)
+         size >>= 1;
+      if (FLOW_TAPS * size * size <= vk.num_particles)
+         return size;
+   }
+   return 0;
+}
+
+static void init_flow_field(void)
+{
+   VkDevice device = vulkan->device;
+   unsigned size = std::max(vk.flow_size, 1u);
+
+   VkImageCreateInfo image = { VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO };
+   image.imageType = VK_IMAGE_TYPE_2D;
+   image.format = VK_FORMAT_R16G16B16A16_SFLOAT;
+   image.extent.width = size;
+   image.extent.height = size;
+   image.extent.depth = 1;
+   image.samples = VK_SAMPLE_COUNT_1_BIT;
+   image.tiling = VK_IMAGE_TILING_OPTIMAL;
+   image.usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+   image.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+   image.mipLevels = 1;
+   image.arrayLayers = 1;
+   vkCreateImage(device, &image, nullptr, &vk.flow_image);
+
+   VkMemoryAllocateInfo alloc = { VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO };
+   VkMemoryRequirements mem_reqs;
+   vkGetImageMemoryRequirements(device, vk.flow_image, &mem_reqs);
+   alloc.allocationSize = mem_reqs.size;
+   alloc.memoryTypeIndex = find_memory_type_from_requirements(
+         mem_reqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+   vkAllocateMemory(device, &alloc, nullptr, &vk.flow_memory);
+   vkBindImageMemory(device, vk.flow_image, vk.flow_memory, 0);
+
+   VkImageViewCreateInfo view = { VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO };
+   view.image = vk.flow_image;
+   view.viewType = VK_IMAGE_VIEW_TYPE_2D;
+   view.format = VK_FORMAT_R16G16B16A16_SFLOAT;
+   view.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+   view.subresourceRange.levelCount = 1;
+   view.subresourceRange.layerCount = 1;
+   vkCreateImageView(device, &view, nullptr, &vk.flow_view);
+
+   // Bilinear between the texel centers, clamped at the edges. Particles beyond them are retired anyway.
+   VkSamplerCreateInfo sampler = { VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO };
+   sampler.magFilter = VK_FILTER_LINEAR;
+   sampler.minFilter = VK_FILTER_LINEAR;
+   sampler.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+   sampler.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+   sampler.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+   sampler.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+   sampler.maxLod = 0.0f;
+   vkCreateSampler(device, &sampler, nullptr, &vk.flow_sampler);
+
+   // flow.comp writes the image and move.comp samples it in the general layout, so it never changes.
+   auto cmd = vk.cmd[0];
+   VkCommandBufferBeginInfo begin_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
+   begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+   vkResetCommandBuffer(cmd, 0);
+   vkBeginCommandBuffer(cmd, &begin_info);
+
+   VkImageMemoryBarrier barrier = { VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER };
+   barrier.srcAccessMask = 0;
+   barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+   barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+   barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+   barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+   barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+   barrier.image = vk.flow_image;
+   barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+   barrier.subresourceRange.levelCount = 1;
+   barrier.subresourceRange.layerCount = 1;
+   vkCmdPipelineBarrier(cmd,
+         VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+         false,
+         0, nullptr,
+         0, nullptr,
+         1, &barrier);
+   vkEndCommandBuffer(cmd);
+
+   VkSubmitInfo submit = { VK_STRUCTURE_TYPE_SUBMIT_INFO };
+   submit.commandBufferCount = 1;
+   submit.pCommandBuffers = &cmd;
+   vulkan->lock_queue(vulkan->handle);
+   vkQueueSubmit(vulkan->queue, 1, &submit, VK_NULL_HANDLE);
+   vulkan->unlock_queue(vulkan->handle);
+   vkQueueWaitIdle(vulkan->queue);
+}
+
+static void deinit_flow_field(void)
+{
+   VkDevice device = vulkan->device;
+   vkDestroySampler(device, vk.flow_sampler, nullptr);
+   vkDestroyImageView(device, vk.flow_view, nullptr);
+   vkDestroyImage(device, vk.flow_image, nullptr);
+   vkFreeMemory(device, vk.flow_memory, nullptr);
+}
+
+// Storage buffers of the compute shaders: positions, velocities, colors, requests,
+// song events, dispatches, the free list and the draw list.
+#define NUM_BUFFER_BINDINGS 8
+
+// After them, the flow field as flow.comp writes it and as move.comp samples it.
+#define FLOW_IMAGE_BINDING 8
+#define FLOW_SAMPLER_BINDING 9
+#define NUM_BINDINGS 10
+
+static VkDescriptorType descriptor_type(unsigned binding)
+{
+   switch (binding)
+   {
+      case FLOW_IMAGE_BINDING:
+         return VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+      case FLOW_SAMPLER_BINDING:
+         return VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+      default:
+         return VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+   }
+}
+
+// Points every binding of the descriptor set at the current buffers and images.
+static void write_descriptors(void)
+{
+   VkWriteDescriptorSet writes[NUM_BINDINGS] = {};
+   VkDescriptorBufferInfo buffer_infos[NUM_BUFFER_BINDINGS] = {};
+   VkDescriptorImageInfo image_infos[NUM_BINDINGS - NUM_BUFFER_BINDINGS] = {};
+
+   for (unsigned i = 0; i < NUM_BINDINGS; i++)
+   {
+      writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+      writes[i].dstSet = vk.desc_set;
+      writes[i].dstBinding = i;
+      writes[i].descriptorCount = 1;
+      writes[i].descriptorType = descriptor_type(i);
+      if (i < NUM_BUFFER_BINDINGS)
+         writes[i].pBufferInfo = &buffer_infos[i];
+      else
+         writes[i].pImageInfo = &image_infos[i - NUM_BUFFER_BINDINGS];
+   }
+
+   // Layouts that leave a particle buffer empty never touch its binding, but it must be valid.
+   for (unsigned i = 0; i < NUM_PARTICLE_BUFFERS; i++)
+   {
+      buffer_infos[i].buffer = vk.particles[i].buffer != VK_NULL_HANDLE ? vk.particles[i].buffer : vk.particles[0].buffer;
+      buffer_infos[i].range = VK_WHOLE_SIZE;
+   }
+   buffer_infos[3].buffer = vk.requests.buffer;
+   buffer_infos[3].range = MAX_SYNC * MAX_EMIT_REQUESTS * sizeof(EmitRequest);
+   buffer_infos[4].buffer = vk.song_events.buffer;
+   buffer_infos[4].range = VK_WHOLE_SIZE;
+   buffer_infos[5].buffer = vk.dispatches.buffer;
+   buffer_infos[5].range = DISPATCHES_SIZE;
+   buffer_infos[6].buffer = vk.free_list.buffer;
+   buffer_infos[6].range = FREE_LIST_SIZE(vk.num_particles);
+   buffer_infos[7].buffer = vk.draw_list.buffer;
+   buffer_infos[7].range = DRAW_LIST_SIZE(vk.num_particles);
+
+   // Both stay in the general layout.
+   for (auto &info : image_infos)
+   {
+      info.sampler = vk.flow_sampler;
+      info.imageView = vk.flow_view;
+      info.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+   }
+
+   vkUpdateDescriptorSets(vulkan->device, NUM_BINDINGS, writes, 0, nullptr);
+}
+
 static void init_descriptor(void)
 {
    VkDevice device = vulkan->device;
 
-   VkDescriptorSetLayoutBinding bindings[3] = {};
-   for (unsigned i = 0; i < 3; i++)
+   VkDescriptorSetLayoutBinding bindings[NUM_BINDINGS] = {};
+   for (unsigned i = 0; i < NUM_BINDINGS; i++)
    {
       bindings[i].binding = i;
-      bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+      bindings[i].descriptorType = descriptor_type(i);
       bindings[i].descriptorCount = 1;
       bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
    }
 
    const VkDescriptorPoolSize pool_sizes[3] = {
-      { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1 },
-      { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1 },
-      { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1 },
+      { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, NUM_BUFFER_BINDINGS },
+      { VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1 },
+      { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1 },
    };
 
    VkDescriptorSetLayoutCreateInfo set_layout_info = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO };
-   set_layout_info.bindingCount = 3;
+   set_layout_info.bindingCount = NUM_BINDINGS;
    set_layout_info.pBindings = bindings;
    vkCreateDescriptorSetLayout(device, &set_layout_info, nullptr, &vk.set_layout);
 
@@ -765,30 +1422,7 @@ static void init_descriptor(void)
 
    vkAllocateDescriptorSets(device, &alloc_info, &vk.desc_set);
 
-   VkWriteDescriptorSet writes[3] = {
-      { VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET },
-      { VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET },
-      { VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET },
-   };
-   VkDescriptorBufferInfo buffer_infos[3] = {};
-
-   for (unsigned i = 0; i < 3; i++)
-   {
-      writes[i].dstSet = vk.desc_set;
-      writes[i].dstBinding = i;
-      writes[i].descriptorCount = 1;
-      writes[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-      writes[i].pBufferInfo = &buffer_infos[i];
-   }
-
-   buffer_infos[0].buffer = vk.positions.buffer;
-   buffer_infos[0].range = NUM_PARTICLES * 2 * sizeof(float);
-   buffer_infos[1].buffer = vk.velocity.buffer;
-   buffer_infos[1].range = NUM_PARTICLES * 2 * sizeof(uint16_t);
-   buffer_infos[2].buffer = vk.color.buffer;
-   buffer_infos[2].range = NUM_PARTICLES * 4 * sizeof(uint16_t);
-
-   vkUpdateDescriptorSets(device, 3, writes, 0, nullptr);
+   write_descriptors();
 
    // Particle pipeline
    static const VkPushConstantRange ranges[1] = {
@@ -818,56 +1452,250 @@ static void init_descriptor(void)
    ///
 }
 
-static void init_generation_pipeline()
+// Every candidate divides the particle budget and the particle count of every emitter request.
+// Vulkan guarantees workgroups of at least 128 invocations, so all of them are always allowed.
+static const unsigned group_size_candidates[] = { 32, 64, 128 };
+#define NUM_GROUP_SIZE_CANDIDATES (sizeof(group_size_candidates) / sizeof(group_size_candidates[0]))
+
+// Matches the specialization constants in shaders/compute.inc and shaders/locate.comp.
+struct Specialization
+{
+   uint32_t group_size;
+   uint32_t particle_mask;
+   uint32_t max_groups;
+   uint32_t layout;
+   VkBool32 flow_field;
+};
+
+static const VkSpecializationMapEntry specialization_entries[] = {
+   { 0, offsetof(Specialization, group_size), sizeof(uint32_t) },
+   { 1, offsetof(Specialization, particle_mask), sizeof(uint32_t) },
+   { 2, offsetof(Specialization, max_groups), sizeof(uint32_t) },
+   { 3, offsetof(Specialization, layout), sizeof(uint32_t) },
+   { 4, offsetof(Specialization, flow_field), sizeof(VkBool32) },
+};
+
+static VkPipeline create_compute_pipeline(const uint32_t *code, size_t size, unsigned group_size)
 {
    VkDevice device = vulkan->device;
+   Specialization data = { group_size, vk.num_particles - 1u,
+      std::min(vk.gpu_properties.limits.maxComputeWorkGroupCount[0], vk.num_particles / group_size),
+      uint32_t(vk.layout), vk.flow_size != 0 };
+   VkSpecializationInfo specialization = { 5, specialization_entries, sizeof(data), &data };
+
    VkComputePipelineCreateInfo pipe = { VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO };
    pipe.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
    pipe.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+   pipe.stage.module = create_shader_module(code, size);
    pipe.stage.pName = "main";
+   pipe.stage.pSpecializationInfo = &specialization;
    pipe.layout = vk.compute_pipeline_layout;
 
+   VkPipeline pipeline;
+   vkCreateComputePipelines(device, vk.pipeline_cache, 1, &pipe, nullptr, &pipeline);
+   vkDestroyShaderModule(device, pipe.stage.module, nullptr);
+   return pipeline;
+}
+
+// Wavefronts are 64 wide on AMD, warps 32 wide on NVIDIA and Intel runs compute at SIMD8 to SIMD32.
+// Anything else keeps 64, which the shaders were written for.
+static unsigned default_group_size(void)
+{
+   switch (vk.gpu_properties.vendorID)
+   {
+      case 0x10de: // NVIDIA
+      case 0x8086: // Intel
+         return 32;
+      default:
+         return 64;
+   }
+}
+
+// Times a few move passes, the widest dispatch there is, with every candidate.
+// Runs before anything is emitted and clears the particles again afterwards.
+static unsigned tune_group_size(const uint32_t *move_code, size_t move_size)
+{
+   const unsigned passes = 8;
+   VkDevice device = vulkan->device;
+
+   VkQueryPoolCreateInfo pool_info = { VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO };
+   pool_info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+   pool_info.queryCount = 2 * NUM_GROUP_SIZE_CANDIDATES;
+   VkQueryPool pool;
+   vkCreateQueryPool(device, &pool_info, nullptr, &pool);
+
+   VkPipeline pipelines[NUM_GROUP_SIZE_CANDIDATES];
+   for (unsigned i = 0; i < NUM_GROUP_SIZE_CANDIDATES; i++)
+      pipelines[i] = create_compute_pipeline(move_code, move_size, group_size_candidates[i]);
+
+   auto cmd = vk.cmd[0];
+   VkCommandBufferBeginInfo begin_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
+   begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+   vkResetCommandBuffer(cmd, 0);
+   vkBeginCommandBuffer(cmd, &begin_info);
+   vkCmdResetQueryPool(cmd, pool, 0, 2 * NUM_GROUP_SIZE_CANDIDATES);
+
+   // Cleared particles are skipped by move.comp, so fill them with halves and floats of about 1.0 first.
+   // That makes every particle opaque, whatever the layout, and the bounds keep all of them alive.
+   fill_particles(cmd, 0x3c003c00);
+   pipeline_barrier(cmd,
+         VK_PIPELINE_STAGE_TRANSFER_BIT,
+         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+         VK_ACCESS_TRANSFER_WRITE_BIT,
+         VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+
+   MovePush push;
+   push.bound_x = FLT_MAX;
+   push.bound_y = FLT_MAX;
+   vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE,
+         vk.compute_pipeline_layout, 0, 1, &vk.desc_set, 0, nullptr);
+
+   for (unsigned i = 0; i < NUM_GROUP_SIZE_CANDIDATES; i++)
+   {
+      vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipelines[i]);
+      vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, pool, 2 * i);
+      for (unsigned j = 0; j < passes; j++)
+      {
+         dispatch_particles(cmd, push, group_size_candidates[i]);
+         pipeline_barrier(cmd,
+               VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+               VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+               VK_ACCESS_SHADER_WRITE_BIT,
+               VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+      }
+      vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, pool, 2 * i + 1);
+   }
+
+   pipeline_barrier(cmd,
+         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+         VK_PIPELINE_STAGE_TRANSFER_BIT,
+         VK_ACCESS_SHADER_WRITE_BIT,
+         VK_ACCESS_TRANSFER_WRITE_BIT);
+   fill_particles(cmd, 0);
+   vkCmdFillBuffer(cmd, vk.draw_list.buffer, 0, DRAW_LIST_INDICES, 0);
+   vkEndCommandBuffer(cmd);
+
+   VkSubmitInfo submit = { VK_STRUCTURE_TYPE_SUBMIT_INFO };
+   submit.commandBufferCount = 1;
+   submit.pCommandBuffers = &cmd;
+   vulkan->lock_queue(vulkan->handle);
+   vkQueueSubmit(vulkan->queue, 1, &submit, VK_NULL_HANDLE);
+   vulkan->unlock_queue(vulkan->handle);
+   vkQueueWaitIdle(vulkan->queue);
+
+   uint64_t timestamps[2 * NUM_GROUP_SIZE_CANDIDATES];
+   VkResult res = vkGetQueryPoolResults(device, pool, 0, 2 * NUM_GROUP_SIZE_CANDIDATES,
+         sizeof(timestamps), timestamps, sizeof(uint64_t),
+         VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT);
+
+   unsigned best = default_group_size();
+   uint64_t best_time = UINT64_MAX;
+   for (unsigned i = 0; i < NUM_GROUP_SIZE_CANDIDATES; i++)
+   {
+      uint64_t time = timestamps[2 * i + 1] - timestamps[2 * i];
+      if (res == VK_SUCCESS && time < best_time)
+      {
+         best = group_size_candidates[i];
+         best_time = time;
+      }
+      vkDestroyPipeline(device, pipelines[i], nullptr);
+   }
+
+   vkDestroyQueryPool(device, pool, nullptr);
+   return best;
+}
+
+// With the auto-tune option, the fastest size is measured once per device and driver
+// and kept in the save directory.
+static unsigned choose_group_size(const uint32_t *move_code, size_t move_size)
+{
+   if (!get_option_enabled("midiviz_autotune") || !vk.gpu_properties.limits.timestampComputeAndGraphics)
+      return default_group_size();
+
+   std::string path;
+   const char *dir = nullptr;
+   if (environ_cb(RETRO_ENVIRONMENT_GET_SAVE_DIRECTORY, &dir) && dir && *dir)
+   {
+      char name[64];
+      snprintf(name, sizeof(name), "midiviz-groupsize-%04x-%04x-%08x.txt",
+            vk.gpu_properties.vendorID, vk.gpu_properties.deviceID, vk.gpu_properties.driverVersion);
+      path = dir;
+      if (path.back() != '/' && path.back() != '\\')
+         path += '/';
+      path += name;
+
+      FILE *file = fopen(path.c_str(), "r");
+      if (file)
+      {
+         unsigned size = 0;
+         bool valid = fscanf(file, "%u", &size) == 1 &&
+            std::find(std::begin(group_size_candidates), std::end(group_size_candidates), size) !=
+            std::end(group_size_candidates);
+         fclose(file);
+         if (valid)
+            return size;
+      }
+   }
+
+   unsigned size = tune_group_size(move_code, move_size);
+   fprintf(stderr, "Tuned compute workgroup size: %u.\n", size);
+
+   if (!path.empty())
+   {
+      FILE *file = fopen(path.c_str(), "w");
+      if (file)
+      {
+         fprintf(file, "%u\n", size);
+         fclose(file);
+      }
+   }
+   return size;
+}
+
+static void init_generation_pipeline()
+{
    static const uint32_t generate_comp[] =
 #include "shaders/generate.comp.inc"
       ;
 
-   static const uint32_t pluck_comp[] =
-#include "shaders/pluck.comp.inc"
-      ;
-
-   static const uint32_t move_comp[] =
-#include "shaders/move.comp.inc"
+   static const uint32_t locate_comp[] =
+#include "shaders/locate.comp.inc"
       ;
 
-   static const uint32_t arp_comp[] =
-#include "shaders/arp.comp.inc"
+   static const uint32_t emit_comp[] =
+#include "shaders/emit.comp.inc"
       ;
 
-   static const uint32_t bass_comp[] =
-#include "shaders/bass.comp.inc"
+   static const uint32_t move_comp[] =
+#include "shaders/move.comp.inc"
       ;
 
-   static const uint32_t lead_comp[] =
-#include "shaders/lead.comp.inc"
+   static const uint32_t flow_comp[] =
+#include "shaders/flow.comp.inc"
       ;
 
-   static const uint32_t piano_comp[] =
-#include "shaders/piano.comp.inc"
-      ;
+   // The size is kept when the pipelines are rebuilt for a new particle budget.
+   if (!vk.group_size)
+      vk.group_size = choose_group_size(move_comp, sizeof(move_comp));
 
 #define BUILD(x) \
-   pipe.stage.module = create_shader_module(x##_comp, sizeof(x##_comp)); \
-   vkCreateComputePipelines(device, vk.pipeline_cache, \
-         1, &pipe, nullptr, &vk.x##_pipeline); \
-   vkDestroyShaderModule(device, pipe.stage.module, nullptr)
+   vk.x##_pipeline = create_compute_pipeline(x##_comp, sizeof(x##_comp), vk.group_size)
 
    BUILD(generate);
    BUILD(move);
-   BUILD(pluck);
-   BUILD(arp);
-   BUILD(bass);
-   BUILD(lead);
-   BUILD(piano);
+   BUILD(locate);
+   BUILD(emit);
+   BUILD(flow);
+}
+
+static void deinit_generation_pipeline()
+{
+   VkDevice device = vulkan->device;
+   vkDestroyPipeline(device, vk.generate_pipeline, nullptr);
+   vkDestroyPipeline(device, vk.locate_pipeline, nullptr);
+   vkDestroyPipeline(device, vk.move_pipeline, nullptr);
+   vkDestroyPipeline(device, vk.emit_pipeline, nullptr);
+   vkDestroyPipeline(device, vk.flow_pipeline, nullptr);
 }
 
 static void init_quad_pipeline(VkPipeline &pipeline,
@@ -1022,9 +1850,21 @@ static void init_particle_pipeline()
    bindings[1].binding = 1;
    bindings[1].stride = 8;
    bindings[1].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+   unsigned num_bindings = 2;
+
+   // Whole particles come from one binding, with the color after the position and velocity.
+   if (vk.layout != LAYOUT_SPLIT)
+   {
+      if (vk.layout == LAYOUT_QUANTIZED)
+         attributes[0].format = VK_FORMAT_R16G16_SNORM;
+      attributes[1].binding = 0;
+      attributes[1].offset = particle_layouts[vk.layout].sizes[0] - 4 * sizeof(uint16_t);
+      bindings[0].stride = particle_layouts[vk.layout].sizes[0];
+      num_bindings = 1;
+   }
 
    VkPipelineVertexInputStateCreateInfo vertex_input = { VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO };
-   vertex_input.vertexBindingDescriptionCount = 2;
+   vertex_input.vertexBindingDescriptionCount = num_bindings;
    vertex_input.pVertexBindingDescriptions = bindings;
    vertex_input.vertexAttributeDescriptionCount = 2;
    vertex_input.pVertexAttributeDescriptions = attributes;
@@ -1228,6 +2068,183 @@ static void init_command(void)
    }
 }
 
+// Swaps the particle buffers for ones of a new budget or layout. Everything else stays, but all particles die.
+static void rebuild_particles(unsigned count, ParticleLayout layout)
+{
+   VkDevice device = vulkan->device;
+   vkDeviceWaitIdle(device);
+   deinit_generation_pipeline();
+   vkDestroyPipeline(device, vk.particle_pipeline, nullptr);
+   deinit_particle_buffers();
+
+   vk.num_particles = count;
+   vk.layout = layout;
+   init_particle_buffers();
+   write_descriptors();
+   init_particle_pipeline();
+   init_generation_pipeline();
+}
+
+// Swaps the flow field for one of a new size, or for the per particle noise with a size of 0.
+static void rebuild_flow_field(unsigned size)
+{
+   vkDeviceWaitIdle(vulkan->device);
+   deinit_generation_pipeline();
+   deinit_flow_field();
+
+   vk.flow_size = size;
+   init_flow_field();
+   write_descriptors();
+   init_generation_pipeline();
+}
+
+#define BENCHMARK_PASSES 8
+
+// With the benchmark option, times move.comp and the particle pass over the whole budget with every
+// layout and prints the bandwidth they reach. The move time includes flow.comp when the flow field
+// is on, so running it with and without compares the two noise paths. All particles are alive and on screen.
+// Runs before anything is emitted and leaves the particles cleared.
+static void benchmark_layouts(void)
+{
+   if (!get_option_enabled("midiviz_benchmark") || !vk.gpu_properties.limits.timestampComputeAndGraphics)
+      return;
+
+   VkDevice device = vulkan->device;
+   ParticleLayout layout = vk.layout;
+   unsigned count = vk.num_particles;
+
+   VkQueryPoolCreateInfo pool_info = { VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO };
+   pool_info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+   pool_info.queryCount = 4;
+   VkQueryPool pool;
+   vkCreateQueryPool(device, &pool_info, nullptr, &pool);
+
+   for (unsigned i = 0; i < NUM_LAYOUTS; i++)
+   {
+      rebuild_particles(count, ParticleLayout(i));
+
+      auto cmd = vk.cmd[0];
+      VkCommandBufferBeginInfo begin_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
+      begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+      vkResetCommandBuffer(cmd, 0);
+      vkBeginCommandBuffer(cmd, &begin_info);
+      vkCmdResetQueryPool(cmd, pool, 0, 4);
+
+      MovePush push;
+      push.bound_x = float(width) / height + SCREEN_MARGIN;
+      push.bound_y = 1.0f + SCREEN_MARGIN;
+      vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE,
+            vk.compute_pipeline_layout, 0, 1, &vk.desc_set, 0, nullptr);
+      vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, vk.generate_pipeline);
+      dispatch_particles(cmd, push, vk.group_size);
+
+      // The first move pass lists every particle. The ones after it run past the end of the list,
+      // which move.comp ignores, so the count is set right again before drawing.
+      const VkDrawIndexedIndirectCommand draw = { 0, 1, 0, 0, 0 };
+      vkCmdUpdateBuffer(cmd, vk.draw_list.buffer, 0, sizeof(draw), &draw);
+      pipeline_barrier(cmd,
+            VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+            VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+            VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+
+      vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, pool, 0);
+      for (unsigned j = 0; j < BENCHMARK_PASSES; j++)
+      {
+         update_flow_field(cmd, push.frame);
+         pipeline_barrier(cmd,
+               VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+               VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+               VK_ACCESS_SHADER_WRITE_BIT,
+               VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+         vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, vk.move_pipeline);
+         dispatch_particles(cmd, push, vk.group_size);
+         pipeline_barrier(cmd,
+               VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+               VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+               VK_ACCESS_SHADER_WRITE_BIT,
+               VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+      }
+      vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, pool, 1);
+
+      pipeline_barrier(cmd,
+            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+            VK_PIPELINE_STAGE_TRANSFER_BIT,
+            VK_ACCESS_SHADER_WRITE_BIT,
+            VK_ACCESS_TRANSFER_WRITE_BIT);
+      vkCmdFillBuffer(cmd, vk.draw_list.buffer, 0, sizeof(uint32_t), count);
+      pipeline_barrier(cmd,
+            VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+            VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+            VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+            VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_INDEX_READ_BIT | VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT);
+
+      VkImageMemoryBarrier prepare_rendering = { VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER };
+      prepare_rendering.srcAccessMask = 0;
+      prepare_rendering.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_COLOR_ATTACHMENT_READ_BIT;
+      prepare_rendering.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+      prepare_rendering.newLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+      prepare_rendering.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+      prepare_rendering.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+      prepare_rendering.image = vk.images[0].create_info.image;
+      prepare_rendering.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+      prepare_rendering.subresourceRange.levelCount = 1;
+      prepare_rendering.subresourceRange.layerCount = 1;
+      vkCmdPipelineBarrier(cmd,
+            VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+            false,
+            0, nullptr,
+            0, nullptr,
+            1, &prepare_rendering);
+
+      VkClearValue clear_value = {};
+      VkRenderPassBeginInfo rp_begin = { VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO };
+      rp_begin.renderPass = vk.render_pass;
+      rp_begin.framebuffer = vk.framebuffers[0];
+      rp_begin.renderArea.extent.width = width;
+      rp_begin.renderArea.extent.height = height;
+      rp_begin.clearValueCount = 1;
+      rp_begin.pClearValues = &clear_value;
+
+      vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, pool, 2);
+      for (unsigned j = 0; j < BENCHMARK_PASSES; j++)
+      {
+         vkCmdBeginRenderPass(cmd, &rp_begin, VK_SUBPASS_CONTENTS_INLINE);
+         draw_particles(cmd);
+         vkCmdEndRenderPass(cmd);
+      }
+      vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, pool, 3);
+      vkEndCommandBuffer(cmd);
+
+      VkSubmitInfo submit = { VK_STRUCTURE_TYPE_SUBMIT_INFO };
+      submit.commandBufferCount = 1;
+      submit.pCommandBuffers = &cmd;
+      vulkan->lock_queue(vulkan->handle);
+      vkQueueSubmit(vulkan->queue, 1, &submit, VK_NULL_HANDLE);
+      vulkan->unlock_queue(vulkan->handle);
+      vkQueueWaitIdle(vulkan->queue);
+
+      uint64_t timestamps[4];
+      if (vkGetQueryPoolResults(device, pool, 0, 4, sizeof(timestamps), timestamps, sizeof(uint64_t),
+               VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT) != VK_SUCCESS)
+         continue;
+
+      // Every move pass reads and writes all of a particle, the particle pass reads its position, color and index.
+      double period = vk.gpu_properties.limits.timestampPeriod;
+      double move_ns = double(timestamps[1] - timestamps[0]) * period / BENCHMARK_PASSES;
+      double draw_ns = double(timestamps[3] - timestamps[2]) * period / BENCHMARK_PASSES;
+      double moved = 2.0 * double(PARTICLE_SIZE(i) - 2 * sizeof(uint32_t)) * count;
+      double drawn = double(particle_layouts[i].drawn_size + sizeof(uint32_t)) * count;
+      fprintf(stderr, "Particle layout %-11s, flow field %4u: move %8.3f ms (%6.1f GB/s), draw %8.3f ms (%6.1f GB/s).\n",
+            particle_layouts[i].name, vk.flow_size,
+            move_ns * 1e-6, moved / move_ns,
+            draw_ns * 1e-6, drawn / draw_ns);
+   }
+
+   vkDestroyQueryPool(device, pool, nullptr);
+   rebuild_particles(count, layout);
+}
+
 static void vulkan_test_init(void)
 {
    vkGetPhysicalDeviceProperties(vulkan->gpu, &vk.gpu_properties);
@@ -1240,9 +2257,13 @@ static void vulkan_test_init(void)
          num_images = i + 1;
    vk.num_swapchain_images = num_images;
    vk.swapchain_mask = mask;
+   vk.layout = particle_layout();
+   vk.num_particles = particle_budget(vk.layout);
+   vk.flow_size = flow_field_size();
 
    init_command();
    init_buffers();
+   init_flow_field();
    init_descriptor();
 
    VkPipelineCacheCreateInfo pipeline_cache_info = { VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO };
@@ -1252,6 +2273,7 @@ static void vulkan_test_init(void)
    init_render_pass(VK_FORMAT_A2R10G10B10_UNORM_PACK32);
    init_pipelines();
    init_swapchain();
+   benchmark_layouts();
 }
 
 static void vulkan_test_deinit(void)
@@ -1278,20 +2300,17 @@ static void vulkan_test_deinit(void)
    vkDestroyPipelineLayout(device, vk.compute_pipeline_layout, nullptr);
 
    vkDestroyPipeline(device, vk.particle_pipeline, nullptr);
-   vkDestroyPipeline(device, vk.generate_pipeline, nullptr);
-   vkDestroyPipeline(device, vk.move_pipeline, nullptr);
-   vkDestroyPipeline(device, vk.pluck_pipeline, nullptr);
+   deinit_generation_pipeline();
    vkDestroyPipeline(device, vk.kick_pipeline, nullptr);
    vkDestroyPipeline(device, vk.snare_pipeline, nullptr);
-   vkDestroyPipeline(device, vk.arp_pipeline, nullptr);
-   vkDestroyPipeline(device, vk.bass_pipeline, nullptr);
-   vkDestroyPipeline(device, vk.lead_pipeline, nullptr);
-   vkDestroyPipeline(device, vk.piano_pipeline, nullptr);
 
    free_buffer(device, &vk.vbo);
-   free_buffer(device, &vk.positions);
-   free_buffer(device, &vk.velocity);
-   free_buffer(device, &vk.color);
+   deinit_particle_buffers();
+   deinit_flow_field();
+   vkUnmapMemory(device, vk.requests.memory);
+   free_buffer(device, &vk.requests);
+   free_buffer(device, &vk.song_events);
+   free_buffer(device, &vk.dispatches);
 
    vkDestroyPipelineCache(device, vk.pipeline_cache, nullptr);
 
@@ -1366,7 +2385,6 @@ void retro_run(void)
             msg, 180,
          };
          environ_cb(RETRO_ENVIRONMENT_SET_MESSAGE, &seek_msg);
-         reset_state();
       }
    }
    else if (!right)
@@ -1395,7 +2413,6 @@ void retro_run(void)
             msg, 180,
          };
          environ_cb(RETRO_ENVIRONMENT_SET_MESSAGE, &seek_msg);
-         reset_state();
       }
    }
    else if (!left)
@@ -1408,9 +2425,30 @@ void retro_run(void)
       vulkan_test_init();
    }
 
+   bool updated = false;
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE_UPDATE, &updated) && updated)
+   {
+      ParticleLayout layout = particle_layout();
+      unsigned count = particle_budget(layout);
+      if (count != vk.num_particles || layout != vk.layout)
+      {
+         rebuild_particles(count, layout);
+         fprintf(stderr, "Particle budget: %u, layout: %s.\n", count, particle_layouts[layout].name);
+      }
+
+      unsigned flow_size = flow_field_size();
+      if (flow_size != vk.flow_size)
+      {
+         rebuild_flow_field(flow_size);
+         fprintf(stderr, "Flow field: %u.\n", flow_size);
+      }
+   }
+
    vulkan->wait_sync_index(vulkan->handle);
 
    vk.index = vulkan->get_sync_index(vulkan->handle);
+   if (!vk.song_events_uploaded && baked_ready.load(std::memory_order_acquire))
+      upload_song_events();
    vulkan_render();
    vulkan->set_image(vulkan->handle, &vk.images[vk.index], 0, nullptr, VK_QUEUE_FAMILY_IGNORED);
    vulkan->set_command_buffers(vulkan->handle, 1, &vk.cmd[vk.index]);
@@ -1486,6 +2524,20 @@ static bool retro_init_hw_context(void)
    return true;
 }
 
+// The rendered audio lives next to the MIDI file, e.g. "song.mid" -> "song.wav".
+static std::string audio_path(const struct retro_game_info *info)
+{
+   if (!info || !info->path)
+      return "Forever Summer.wav";
+
+   std::string path = info->path;
+   size_t dot = path.find_last_of('.');
+   size_t slash = path.find_last_of("/\\");
+   if (dot != std::string::npos && (slash == std::string::npos || dot > slash))
+      path.erase(dot);
+   return path + ".wav";
+}
+
 bool retro_load_game(const struct retro_game_info *info)
 {
    if (!retro_init_hw_context())
@@ -1494,10 +2546,36 @@ bool retro_load_game(const struct retro_game_info *info)
       return false;
    }
 
-   midi_file = MIDI::File(60.0, "Forever Summer.mid");
+   // Parsed timelines are cached next to the saves, so reloading a big song is instant.
+   const char *cache_dir = nullptr;
+   if (!environ_cb(RETRO_ENVIRONMENT_GET_SAVE_DIRECTORY, &cache_dir))
+      cache_dir = nullptr;
+
+   // Streaming decodes from the file while playing, so it needs a path rather than the
+   // frontend's buffer, which is not guaranteed to outlive retro_load_game.
+   bool streaming = info && info->path && get_option_enabled("midiviz_streaming");
+
+   try
+   {
+      if (streaming)
+         midi_file = MIDI::File::open_streaming(60.0, info->path);
+      // need_fullpath is false, so the frontend hands us the song in memory.
+      else if (info && info->data)
+         midi_file = MIDI::File(60.0, info->data, info->size, cache_dir);
+      else
+      {
+         std::string path = info && info->path ? info->path : "Forever Summer.mid";
+         midi_file = MIDI::File(60.0, path.c_str(), cache_dir);
+      }
+   }
+   catch (const std::exception &e)
+   {
+      fprintf(stderr, "Failed to load MIDI: %s\n", e.what());
+      return false;
+   }
 
    SF_INFO sf_info;
-   audio_file = sf_open("Forever Summer.wav", SFM_READ, &sf_info);
+   audio_file = sf_open(audio_path(info).c_str(), SFM_READ, &sf_info);
    if (!audio_file)
       return false;
 
@@ -1516,15 +2594,20 @@ bool retro_load_game(const struct retro_game_info *info)
    if (!use_audio_cb)
       audio_cb_enable.store(true);
 
+   // Streaming exists to avoid decoding the whole song up front, so it is not baked.
+   // Otherwise the bake walks a second cursor over the timeline that was just parsed.
+   if (!streaming)
+      start_bake(midi_file.share());
+
    retro_reset();
 
    fprintf(stderr, "Loaded game!\n");
-   (void)info;
    return true;
 }
 
 void retro_unload_game(void)
 {
+   stop_bake();
    if (audio_file)
       sf_close(audio_file);
    audio_file = nullptr;
@@ -1586,7 +2669,6 @@ void retro_reset(void)
    audio_lock.unlock();
 
    state.frame = 0;
-   reset_state();
 }
 
 void retro_cheat_reset(void)
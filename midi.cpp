@@ -4,6 +4,22 @@
 #include <math.h>
 #include <stdexcept>
 #include <memory>
+#include <chrono>
+#include <string>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <exception>
+#include <condition_variable>
+#include <deque>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 using namespace std;
 
@@ -18,196 +34,1739 @@ namespace MIDI
       }
    };
 
-   static void read_tag(FILE *file, const char *tag)
+   // Read-only view of a whole file.
+   // Uses mmap where available so the parser can read straight from the page cache,
+   // and falls back to reading everything into a single buffer otherwise.
+   class MappedFile
+   {
+      public:
+         MappedFile(const char *path);
+         ~MappedFile();
+
+         MappedFile(const MappedFile &) = delete;
+         void operator=(const MappedFile &) = delete;
+
+         const uint8_t *data() const { return mapped ? mapped : buffer.data(); }
+         size_t size() const { return mapped ? mapped_size : buffer.size(); }
+
+      private:
+         const uint8_t *mapped = nullptr;
+         size_t mapped_size = 0;
+         vector<uint8_t> buffer;
+
+         void read_fallback(const char *path);
+   };
+
+   MappedFile::MappedFile(const char *path)
+   {
+#ifndef _WIN32
+      int fd = open(path, O_RDONLY);
+      if (fd < 0)
+         throw runtime_error("Failed to open MIDI file.");
+
+      struct stat s;
+      if (fstat(fd, &s) == 0 && s.st_size > 0)
+      {
+         void *ptr = mmap(nullptr, size_t(s.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+         if (ptr != MAP_FAILED)
+         {
+            mapped = static_cast<const uint8_t *>(ptr);
+            mapped_size = size_t(s.st_size);
+            madvise(ptr, mapped_size, MADV_SEQUENTIAL);
+         }
+      }
+      close(fd);
+
+      if (mapped)
+         return;
+#endif
+      read_fallback(path);
+   }
+
+   MappedFile::~MappedFile()
+   {
+#ifndef _WIN32
+      if (mapped)
+         munmap(const_cast<uint8_t *>(mapped), mapped_size);
+#endif
+   }
+
+   void MappedFile::read_fallback(const char *path)
+   {
+      unique_ptr<FILE, FILEDeleter> file(fopen(path, "rb"));
+      if (!file)
+         throw runtime_error("Failed to open MIDI file.");
+
+      if (fseek(file.get(), 0, SEEK_END) != 0)
+         throw runtime_error("Failed to read MIDI file.");
+      long len = ftell(file.get());
+      if (len < 0 || fseek(file.get(), 0, SEEK_SET) != 0)
+         throw runtime_error("Failed to read MIDI file.");
+
+      buffer.resize(size_t(len));
+      if (len && fread(buffer.data(), buffer.size(), 1, file.get()) != 1)
+         throw runtime_error("Failed to read MIDI file.");
+   }
+
+   static void read_tag(const uint8_t *&data, const uint8_t *end, const char *tag)
    {
-      char tmp[4];
-      if (fread(tmp, sizeof(tmp), 1, file) != 1)
+      if (end - data < 4)
          throw runtime_error("Failed to parse MIDI file.");
-      if (memcmp(tmp, tag, 4))
+      if (memcmp(data, tag, 4))
          throw runtime_error("Failed to parse MIDI file.");
+      data += 4;
    }
 
-   static uint32_t read_u32(FILE *file)
+   static uint32_t read_u32(const uint8_t *&data, const uint8_t *end)
    {
-      uint8_t v[4];
-      if (fread(v, sizeof(v), 1, file) != 1)
+      if (end - data < 4)
          throw runtime_error("Failed to parse MIDI file.");
-      return (v[0] << 24) | (v[1] << 16) | (v[2] << 8) | v[3];
+      uint32_t v = (uint32_t(data[0]) << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+      data += 4;
+      return v;
    }
 
-   static uint16_t read_u16(FILE *file)
+   static uint16_t read_u16(const uint8_t *&data, const uint8_t *end)
    {
-      uint8_t v[2];
-      if (fread(v, sizeof(v), 1, file) != 1)
+      if (end - data < 2)
          throw runtime_error("Failed to parse MIDI file.");
-      return (v[0] << 8) | v[1];
+      uint16_t v = (data[0] << 8) | data[1];
+      data += 2;
+      return v;
+   }
+
+   static void log_load(const char *source, size_t size, chrono::steady_clock::time_point start)
+   {
+      double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+      double mb = double(size) / (1024.0 * 1024.0);
+      fprintf(stderr, "Loaded MIDI file %s: %.2f MB in %.1f ms (%.1f MB/s).\n",
+            source, mb, seconds * 1e3, seconds > 0.0 ? mb / seconds : 0.0);
    }
 
-   File::File(double fps, const char *path)
+   File::File(double fps, const char *path, const char *cache_dir)
       : fps(fps)
    {
-      unique_ptr<FILE, FILEDeleter> file(fopen(path, "rb"));
-      if (!file)
-         throw runtime_error("Failed to open MIDI file.");
+      auto start = chrono::steady_clock::now();
 
-      read_tag(file.get(), "MThd");
+      MappedFile file(path);
+      load(file.data(), file.size(), cache_dir);
 
-      if (read_u32(file.get()) != 6)
-         throw runtime_error("Failed to parse MIDI file.");
+      string source = string("\"") + path + "\"";
+      log_load(source.c_str(), file.size(), start);
+   }
 
-      if (read_u16(file.get()) != 1)
-         throw runtime_error("Expected multitrack file.");
+   File::File(double fps, const void *data, size_t size, const char *cache_dir)
+      : fps(fps)
+   {
+      auto start = chrono::steady_clock::now();
+      load(static_cast<const uint8_t *>(data), size, cache_dir);
+      log_load("from memory", size, start);
+   }
 
-      unsigned num_tracks = read_u16(file.get());
-      tracks.resize(num_tracks);
-      units_per_beat = read_u16(file.get());
+   // Runs func(0) ... func(count - 1) spread over the available cores.
+   // The first exception thrown by any invocation is rethrown on the calling thread.
+   template <typename Func>
+   static void parallel_for(unsigned count, const Func &func)
+   {
+      unsigned num_threads = min(count, max(thread::hardware_concurrency(), 1u));
+      atomic_uint next(0);
+      exception_ptr error;
+      mutex error_lock;
 
-      for (unsigned i = 0; i < num_tracks; i++)
+      auto worker = [&]() {
+         unsigned i;
+         while ((i = next.fetch_add(1, memory_order_relaxed)) < count)
+         {
+            try
+            {
+               func(i);
+            }
+            catch (...)
+            {
+               lock_guard<mutex> holder{error_lock};
+               if (!error)
+                  error = current_exception();
+            }
+         }
+      };
+
+      vector<thread> threads;
+      for (unsigned i = 1; i < num_threads; i++)
+         threads.emplace_back(worker);
+      worker();
+      for (auto &t : threads)
+         t.join();
+
+      if (error)
+         rethrow_exception(error);
+   }
+
+   // A control change, keyed by channel * NumControls + control.
+   struct RawControl
+   {
+      uint32_t tick;
+      uint16_t key;
+      uint16_t value;
+   };
+
+   // Result of decoding one MTrk chunk.
+   // The tick column is rewritten in place to tick deltas before merging.
+   struct RawTrack
+   {
+      vector<uint32_t> ticks;
+      vector<uint16_t> packed;
+      vector<TempoMap::Change> tempo;
+      vector<RawControl> controls;
+   };
+
+   // The layout follows cgranges: leaves are the even indices, and a node at level k has its
+   // children 2^(k-1) to either side. Nodes past the end stand in for the last real subtree.
+   void NoteIndex::build(vector<Note> notes)
+   {
+      this->notes = move(notes);
+      int64_t n = this->notes.size();
+      max_end.resize(n);
+      max_level = -1;
+      if (!n)
+         return;
+
+      int64_t last_i = 0;
+      uint32_t last = 0;
+      for (int64_t i = 0; i < n; i += 2)
       {
-         vector<uint8_t> blob;
-         read_tag(file.get(), "MTrk");
-         unsigned length = read_u32(file.get());
+         last_i = i;
+         last = max_end[i] = this->notes[i].end;
+      }
 
-         blob.resize(length);
-         if (fread(blob.data(), blob.size(), 1, file.get()) != 1)
-            throw runtime_error("Failed to parse MIDI track.");
+      int k;
+      for (k = 1; (int64_t(1) << k) <= n; k++)
+      {
+         int64_t x = int64_t(1) << (k - 1);
+         int64_t step = x << 2;
+         for (int64_t i = (x << 1) - 1; i < n; i += step)
+         {
+            uint32_t end_left = max_end[i - x];
+            uint32_t end_right = i + x < n ? max_end[i + x] : last;
+            max_end[i] = max(this->notes[i].end, max(end_left, end_right));
+         }
 
-         parse_track(tracks[i], blob.data(), blob.size());
+         last_i = ((last_i >> k) & 1) ? last_i - x : last_i + x;
+         if (last_i < n && max_end[last_i] > last)
+            last = max_end[last_i];
       }
+      max_level = k - 1;
    }
 
-   void File::parse_track(Track &track, const uint8_t *data, size_t)
+   void NoteIndex::query(uint32_t tick, vector<Note> &result) const
    {
-      uint32_t current = 0;
-      uint8_t running = 0;
+      struct Node
+      {
+         int64_t x;
+         int k;
+         bool left_done;
+      };
+
+      int64_t n = notes.size();
+      if (!n)
+         return;
 
-      auto read_varint = [&data]() -> uint32_t {
-         uint32_t v = 0;
-         uint8_t inval;
-         do
+      Node stack[64];
+      unsigned top = 0;
+      stack[top++] = { (int64_t(1) << max_level) - 1, max_level, false };
+
+      while (top)
+      {
+         Node node = stack[--top];
+         if (node.k <= 3)
          {
-            inval = *data++;
-            v = (v << 7) | (inval & 0x7f);
-         } while (inval & 0x80);
-         return v;
-      };
+            // Small subtrees are cheaper to scan than to walk.
+            int64_t i0 = node.x >> node.k << node.k;
+            int64_t i1 = min(i0 + (int64_t(1) << (node.k + 1)) - 1, n);
+            for (int64_t i = i0; i < i1 && notes[i].start <= tick; i++)
+               if (tick < notes[i].end)
+                  result.push_back(notes[i]);
+         }
+         else if (!node.left_done)
+         {
+            int64_t left = node.x - (int64_t(1) << (node.k - 1));
+            stack[top++] = { node.x, node.k, true };
+            if (left >= n || max_end[left] > tick)
+               stack[top++] = { left, node.k - 1, false };
+         }
+         else if (node.x < n && notes[node.x].start <= tick)
+         {
+            if (tick < notes[node.x].end)
+               result.push_back(notes[node.x]);
+            stack[top++] = { node.x + (int64_t(1) << (node.k - 1)), node.k - 1, false };
+         }
+      }
+   }
+
+   static void write_varint(vector<uint8_t> &data, uint32_t v)
+   {
+      while (v >= 0x80)
+      {
+         data.push_back(uint8_t(v | 0x80));
+         v >>= 7;
+      }
+      data.push_back(uint8_t(v));
+   }
+
+   static uint32_t read_varint(const vector<uint8_t> &data, size_t &offset)
+   {
+      uint32_t v = 0;
+      for (unsigned shift = 0; offset < data.size() && shift < 32; shift += 7)
+      {
+         uint8_t c = data[offset++];
+         v |= uint32_t(c & 0x7f) << shift;
+         if (!(c & 0x80))
+            break;
+      }
+      return v;
+   }
+
+   void ControlCurve::build(unsigned channel, unsigned control, const vector<Keyframe> &keyframes)
+   {
+      data.clear();
+      checkpoints.clear();
+      this->channel = channel;
+      this->control = control;
+
+      uint32_t last_tick = 0;
+      int last_value = 0;
+      for (size_t i = 0; i < keyframes.size(); i++)
+      {
+         auto &keyframe = keyframes[i];
+         int delta = int(keyframe.value) - last_value;
+         write_varint(data, keyframe.tick - last_tick);
+         write_varint(data, (uint32_t(delta) << 1) ^ uint32_t(delta >> 31));
+         last_tick = keyframe.tick;
+         last_value = keyframe.value;
+
+         if (i % CheckpointStride == 0)
+            checkpoints.push_back({ last_tick, uint32_t(data.size()), uint32_t(last_value) });
+      }
+
+      offset = 0;
+      tick = 0;
+      value = -1;
+   }
+
+   void ControlCurve::assign(unsigned channel, unsigned control, vector<uint8_t> data, vector<Checkpoint> checkpoints)
+   {
+      this->channel = channel;
+      this->control = control;
+      this->data = move(data);
+      this->checkpoints = move(checkpoints);
+      offset = 0;
+      tick = 0;
+      value = -1;
+   }
+
+   int ControlCurve::sample(uint32_t target)
+   {
+      // Going backwards, or not started yet. Restart from the last checkpoint at or before the target.
+      if (value < 0 || target < tick)
+      {
+         auto itr = upper_bound(begin(checkpoints), end(checkpoints), target, [](uint32_t t, const Checkpoint &c) {
+            return t < c.tick;
+         });
+         if (itr == begin(checkpoints))
+         {
+            value = -1;
+            return -1;
+         }
+
+         --itr;
+         offset = itr->offset;
+         tick = itr->tick;
+         value = int(itr->value);
+      }
+
+      while (offset < data.size())
+      {
+         size_t next = offset;
+         uint32_t next_tick = tick + read_varint(data, next);
+         if (next_tick > target)
+            break;
+
+         uint32_t zigzag = read_varint(data, next);
+         value += int(zigzag >> 1) ^ -int(zigzag & 1);
+         tick = next_tick;
+         offset = next;
+      }
+
+      return value;
+   }
+
+   void TempoMap::build(unsigned units_per_beat, vector<Change> changes)
+   {
+      this->units_per_beat = units_per_beat;
+      stable_sort(begin(changes), end(changes), [](const Change &a, const Change &b) {
+         return a.tick < b.tick;
+      });
+      this->changes = changes;
+
+      segments.clear();
+      segments.push_back({ 0, 0.0, 0.5 / units_per_beat });
+      for (auto &change : changes)
+      {
+         auto &last = segments.back();
+         double seconds = last.seconds + double(change.tick - last.tick) * last.seconds_per_tick;
+         // A tempo of zero would stop time. Clamp it so every tick still has a distinct time.
+         double seconds_per_tick = double(max(change.usec_per_beat, 1u)) / (1e6 * units_per_beat);
+
+         if (change.tick == last.tick)
+            last.seconds_per_tick = seconds_per_tick;
+         else
+            segments.push_back({ change.tick, seconds, seconds_per_tick });
+      }
+   }
+
+   double TempoMap::tick_to_seconds(uint32_t tick) const
+   {
+      if (segments.empty())
+         return 0.0;
+
+      auto itr = upper_bound(begin(segments), end(segments), tick, [](uint32_t t, const Segment &seg) {
+         return t < seg.tick;
+      });
+      auto &seg = *(itr - 1);
+      return seg.seconds + double(tick - seg.tick) * seg.seconds_per_tick;
+   }
+
+   double TempoMap::seconds_to_tick(double seconds) const
+   {
+      if (segments.empty())
+         return 0.0;
 
+      auto itr = upper_bound(begin(segments), end(segments), seconds, [](double s, const Segment &seg) {
+         return s < seg.seconds;
+      });
+      if (itr == begin(segments))
+         itr++;
+      auto &seg = *(itr - 1);
+
+      double tick = double(seg.tick);
+      if (seg.seconds_per_tick > 0.0)
+         tick += (seconds - seg.seconds) / seg.seconds_per_tick;
+      return tick;
+   }
+
+   // Incremental decoder for one MTrk chunk.
+   // parse_track() runs it to the end of the track, streaming runs it one window at a time.
+   class TrackDecoder
+   {
+      public:
+         enum class Type
+         {
+            Note,
+            Tempo,
+            Control,
+            End
+         };
+
+         struct Result
+         {
+            Type type;
+            uint32_t tick;
+            uint16_t packed;
+            uint32_t usec_per_beat;
+            uint8_t channel;
+            uint8_t control;
+            uint16_t value;
+         };
+
+         TrackDecoder() = default;
+         TrackDecoder(const uint8_t *data, size_t size)
+            : data(data), end(data + size)
+         {
+         }
+
+         // Skips ahead to the next note, tempo or control event.
+         Result next();
+
+      private:
+         const uint8_t *data = nullptr;
+         const uint8_t *end = nullptr;
+         uint32_t current = 0;
+         uint8_t running = 0;
+
+         void need(size_t count) const
+         {
+            if (size_t(end - data) < count)
+               throw runtime_error("Failed to parse MIDI track.");
+         }
+
+         uint32_t read_varint()
+         {
+            uint32_t v = 0;
+            uint8_t inval;
+            do
+            {
+               need(1);
+               inval = *data++;
+               v = (v << 7) | (inval & 0x7f);
+            } while (inval & 0x80);
+            return v;
+         }
+   };
+
+   TrackDecoder::Result TrackDecoder::next()
+   {
       for (;;)
       {
          uint32_t delta_time = read_varint();
          current += delta_time;
-         uint8_t type = *data >> 4;
+         need(1);
 
-         if (type < 0x8) // Running status
-            type = running;
+         uint8_t status = *data;
+         if (status < 0x80) // Running status
+            status = running;
          else
             data++;
 
+         uint8_t type = status >> 4;
+         uint8_t channel = status & 0xf;
+         if (type >= 0x8 && type < 0xf)
+            running = status;
+
          if (type == 0x9) // KON
          {
+            need(2);
             uint8_t key = *data++;
             uint8_t vel = *data++;
-            running = type;
-
-            double time = time_per_beat * double(current) / double(units_per_beat);
-            uint32_t frame = uint32_t(round(time * fps));
-            track.all_events.push_back({ true, key, vel, frame });
+            return { Type::Note, current, pack_event(true, key, vel), 0 };
          }
          else if (type == 0x8) // KOF
          {
+            need(2);
             uint8_t key = *data++;
             uint8_t vel = *data++;
-            running = type;
-
-            double time = time_per_beat * double(current) / double(units_per_beat);
-            uint32_t frame = uint32_t(round(time * fps));
-            track.all_events.push_back({ true, key, vel, frame });
+            return { Type::Note, current, pack_event(false, key, vel), 0 };
+         }
+         else if (type == 0xa) // Polyphonic aftertouch, kept as channel pressure.
+         {
+            need(2);
+            uint8_t value = data[1];
+            data += 2;
+            return { Type::Control, current, 0, 0, channel, ControlPressure, value };
+         }
+         else if (type == 0xb) // Control change
+         {
+            need(2);
+            uint8_t control = data[0] & 0x7f;
+            uint8_t value = data[1];
+            data += 2;
+            return { Type::Control, current, 0, 0, channel, control, value };
+         }
+         else if (type == 0xd) // Channel pressure
+         {
+            need(1);
+            uint8_t value = *data++;
+            return { Type::Control, current, 0, 0, channel, ControlPressure, value };
          }
-         else if (type == 0xa || type == 0xb || type == 0xe)
+         else if (type == 0xe) // Pitch bend
+         {
+            need(2);
+            uint16_t value = (data[0] & 0x7f) | ((data[1] & 0x7f) << 7);
             data += 2;
-         else if (type == 0xc || type == 0xd)
+            return { Type::Control, current, 0, 0, channel, ControlPitchBend, value };
+         }
+         else if (type == 0xc) // Program change
+         {
+            need(1);
             data += 1;
-         else if (data[-1] == 0xff) // Meta
+         }
+         else if (status == 0xff) // Meta
          {
+            need(1);
             uint8_t type = *data++;
             uint32_t len = read_varint();
+            need(len);
+            const uint8_t *payload = data;
+            data += len;
 
             switch (type)
             {
                case 0x2f: // EoT
-                  return;
+                  data = end;
+                  return { Type::End, current, 0, 0 };
 
                case 0x51: // Set Tempo
-                  time_per_beat = double((data[0] << 16) | (data[1] << 8) | (data[2] << 0)) / 1e6;
+                  if (len >= 3)
+                  {
+                     uint32_t usec = (payload[0] << 16) | (payload[1] << 8) | (payload[2] << 0);
+                     return { Type::Tempo, current, 0, usec };
+                  }
                   break;
 
                case 0x58: // Time signature
-                  //clocks_per_tick = data[2];
+                  //clocks_per_tick = payload[2];
                   break;
             }
-
-            data += len;
          }
          else
             throw runtime_error("Failed to parse MIDI file.");
       }
    }
 
-   unsigned File::get_num_tracks() const
+   static void parse_track(RawTrack &track, const uint8_t *data, size_t size)
    {
-      return tracks.size();
+      TrackDecoder decoder(data, size);
+      for (;;)
+      {
+         auto e = decoder.next();
+         switch (e.type)
+         {
+            case TrackDecoder::Type::Note:
+               track.ticks.push_back(e.tick);
+               track.packed.push_back(e.packed);
+               break;
+
+            case TrackDecoder::Type::Tempo:
+               track.tempo.push_back({ e.tick, e.usec_per_beat });
+               break;
+
+            case TrackDecoder::Type::Control:
+               track.controls.push_back({ e.tick, uint16_t(e.channel * NumControls + e.control), e.value });
+               break;
+
+            case TrackDecoder::Type::End:
+               return;
+         }
+      }
    }
 
-   void File::reset()
+   static void delta_encode(vector<uint32_t> &ticks)
    {
-      for (auto &track : tracks)
-         track.events_ptr = 0;
-      frame = 0;
+      uint32_t last = 0;
+      for (auto &tick : ticks)
+      {
+         uint32_t absolute = tick;
+         tick = absolute - last;
+         last = absolute;
+      }
    }
 
-   void File::step()
+   struct Chunk
+   {
+      const uint8_t *data;
+      size_t size;
+   };
+
+   // Validates the MThd header and locates every MTrk chunk.
+   static vector<Chunk> read_chunks(const uint8_t *data, size_t size, unsigned &units_per_beat)
+   {
+      const uint8_t *end = data + size;
+
+      read_tag(data, end, "MThd");
+
+      if (read_u32(data, end) != 6)
+         throw runtime_error("Failed to parse MIDI file.");
+
+      if (read_u16(data, end) != 1)
+         throw runtime_error("Expected multitrack file.");
+
+      unsigned num_tracks = read_u16(data, end);
+      units_per_beat = read_u16(data, end);
+      if (!units_per_beat || (units_per_beat & 0x8000))
+         throw runtime_error("Unsupported MIDI time division.");
+
+      vector<Chunk> chunks;
+      for (unsigned i = 0; i < num_tracks; i++)
+      {
+         read_tag(data, end, "MTrk");
+         uint32_t length = read_u32(data, end);
+         if (length > size_t(end - data))
+            throw runtime_error("Failed to parse MIDI track.");
+
+         chunks.push_back({ data, length });
+         data += length;
+      }
+
+      return chunks;
+   }
+
+   // Merges per-track columns, each delta encoded from tick 0, into one timeline ordered by tick.
+   // Events on the same tick keep their track order, and within a track their file order.
+   // This is a counting sort over ticks, which is linear as long as the song is not absurdly long
+   // compared to the number of events it has. The inputs are released as they are consumed.
+   static void merge_tracks(vector<vector<uint32_t>> &tick_deltas, vector<vector<uint16_t>> &packed,
+         vector<uint32_t> &out_ticks, vector<uint16_t> &out_packed, vector<uint16_t> &out_tracks)
+   {
+      size_t total = 0;
+      uint32_t max_tick = 0;
+      for (auto &deltas : tick_deltas)
+      {
+         uint32_t tick = 0;
+         for (auto delta : deltas)
+            tick += delta;
+         max_tick = max(max_tick, tick);
+         total += deltas.size();
+      }
+
+      out_ticks.resize(total);
+      out_packed.resize(total);
+      out_tracks.resize(total);
+
+      if (size_t(max_tick) <= 2 * total + (1u << 20))
+      {
+         vector<size_t> offsets(size_t(max_tick) + 2);
+         for (auto &deltas : tick_deltas)
+         {
+            uint32_t tick = 0;
+            for (auto delta : deltas)
+            {
+               tick += delta;
+               offsets[tick + 1]++;
+            }
+         }
+
+         for (size_t i = 1; i < offsets.size(); i++)
+            offsets[i] += offsets[i - 1];
+
+         for (size_t t = 0; t < tick_deltas.size(); t++)
+         {
+            uint32_t tick = 0;
+            for (size_t i = 0; i < tick_deltas[t].size(); i++)
+            {
+               tick += tick_deltas[t][i];
+               size_t index = offsets[tick]++;
+               out_ticks[index] = tick;
+               out_packed[index] = packed[t][i];
+               out_tracks[index] = uint16_t(t);
+            }
+
+            vector<uint32_t>().swap(tick_deltas[t]);
+            vector<uint16_t>().swap(packed[t]);
+         }
+      }
+      else
+      {
+         struct Entry
+         {
+            uint32_t tick;
+            uint16_t packed;
+            uint16_t track;
+         };
+
+         vector<Entry> entries;
+         entries.reserve(total);
+         for (size_t t = 0; t < tick_deltas.size(); t++)
+         {
+            uint32_t tick = 0;
+            for (size_t i = 0; i < tick_deltas[t].size(); i++)
+            {
+               tick += tick_deltas[t][i];
+               entries.push_back({ tick, packed[t][i], uint16_t(t) });
+            }
+
+            vector<uint32_t>().swap(tick_deltas[t]);
+            vector<uint16_t>().swap(packed[t]);
+         }
+
+         stable_sort(begin(entries), end(entries), [](const Entry &a, const Entry &b) {
+            return a.tick < b.tick;
+         });
+
+         for (size_t i = 0; i < total; i++)
+         {
+            out_ticks[i] = entries[i].tick;
+            out_packed[i] = entries[i].packed;
+            out_tracks[i] = entries[i].track;
+         }
+      }
+
+      // Back to deltas, with the first one relative to tick 0.
+      for (size_t i = total; i > 1; i--)
+         out_ticks[i - 1] -= out_ticks[i - 2];
+   }
+
+   // Groups the control changes of all tracks into one curve per channel and control.
+   // Changes on the same tick collapse into the last one, and changes that keep the value are dropped.
+   static vector<ControlCurve> build_curves(vector<vector<RawControl>> &track_controls)
    {
-      is_eof = true;
-      for (auto &track : tracks)
+      vector<RawControl> controls;
+      for (auto &track : track_controls)
+      {
+         controls.insert(controls.end(), track.begin(), track.end());
+         vector<RawControl>().swap(track);
+      }
+
+      stable_sort(begin(controls), end(controls), [](const RawControl &a, const RawControl &b) {
+         return a.key < b.key || (a.key == b.key && a.tick < b.tick);
+      });
+
+      vector<ControlCurve> curves;
+      vector<ControlCurve::Keyframe> keyframes;
+      for (size_t i = 0; i < controls.size(); )
       {
-         track.current_events.clear();
-         while (track.events_ptr < track.all_events.size() &&
-                frame >= track.all_events[track.events_ptr].frame)
+         unsigned key = controls[i].key;
+         keyframes.clear();
+         for (; i < controls.size() && controls[i].key == key; i++)
          {
-            track.current_events.push_back(track.all_events[track.events_ptr]);
-            track.events_ptr++;
-            is_eof = false;
+            auto &control = controls[i];
+            if (!keyframes.empty() && keyframes.back().tick == control.tick)
+            {
+               keyframes.back().value = control.value;
+               if (keyframes.size() > 1 && keyframes[keyframes.size() - 2].value == control.value)
+                  keyframes.pop_back();
+            }
+            else if (keyframes.empty() || keyframes.back().value != control.value)
+               keyframes.push_back({ control.tick, control.value });
          }
 
-         if (track.events_ptr < track.all_events.size())
-            is_eof = false;
+         curves.emplace_back();
+         curves.back().build(key / NumControls, key % NumControls, keyframes);
       }
-      frame++;
+
+      return curves;
    }
 
-   double File::get_beat() const
+   void File::parse(const uint8_t *data, size_t size)
    {
-      return double(frame) / (fps * time_per_beat);
+      auto chunks = read_chunks(data, size, units_per_beat);
+      unsigned track_count = chunks.size();
+
+      // Phase 1: decode every track independently in the tick domain.
+      vector<RawTrack> raw(track_count);
+      parallel_for(track_count, [&](unsigned i) {
+         parse_track(raw[i], chunks[i].data, chunks[i].size);
+      });
+
+      // Phase 2: gather the tempo changes of all tracks into one map.
+      // The timeline stays in ticks, frames are only worked out at the cursor.
+      vector<TempoMap::Change> changes;
+      for (auto &track : raw)
+         changes.insert(changes.end(), track.tempo.begin(), track.tempo.end());
+      tempo.build(units_per_beat, move(changes));
+
+      vector<vector<uint32_t>> tick_deltas(track_count);
+      vector<vector<uint16_t>> packed(track_count);
+      vector<vector<RawControl>> controls(track_count);
+      parallel_for(track_count, [&](unsigned i) {
+         delta_encode(raw[i].ticks);
+         tick_deltas[i] = move(raw[i].ticks);
+         packed[i] = move(raw[i].packed);
+         controls[i] = move(raw[i].controls);
+         raw[i] = RawTrack();
+      });
+
+      // Phase 3: merge everything into the single timeline step() walks.
+      timeline.storage = make_shared<Timeline::Storage>();
+      auto &storage = *timeline.storage;
+      merge_tracks(tick_deltas, packed, storage.ticks, storage.packed, storage.tracks);
+      timeline.tick_deltas = storage.ticks.data();
+      timeline.packed = storage.packed.data();
+      timeline.tracks = storage.tracks.data();
+      timeline.count = storage.packed.size();
+      build_checkpoints(timeline);
+      num_tracks = track_count;
+      build_note_index();
+
+      // Phase 4: control changes become one curve per channel and control.
+      curves = build_curves(controls);
+      build_curve_index();
+
+      size_t num_events = timeline.count;
+      fprintf(stderr, "MIDI: %zu note events in %u tracks, %.2f MB as columns (%.2f MB as an Event array).\n",
+            num_events, track_count,
+            double(num_events * (sizeof(uint32_t) + 2 * sizeof(uint16_t))) / (1024.0 * 1024.0),
+            double(num_events * sizeof(Event)) / (1024.0 * 1024.0));
+
+      size_t curve_bytes = 0;
+      for (auto &curve : curves)
+         curve_bytes += curve.get_data().size() + curve.get_checkpoints().size() * sizeof(ControlCurve::Checkpoint);
+      fprintf(stderr, "MIDI: %zu control curves in %.2f kB.\n", curves.size(), double(curve_bytes) / 1024.0);
+
+      reset();
    }
 
-   void File::seek(unsigned count)
+   // MurmurHash64A. Only used to key the event cache, so it just needs to be fast.
+   static uint64_t hash_data(const uint8_t *data, size_t size)
    {
-      if (count >= frame)
+      const uint64_t m = 0xc6a4a7935bd1e995ull;
+      uint64_t h = 0x8445d61a4e774912ull ^ (uint64_t(size) * m);
+
+      for (; size >= 8; data += 8, size -= 8)
       {
-         for (unsigned i = frame; i < count; i++)
-            step();
+         uint64_t k;
+         memcpy(&k, data, sizeof(k));
+         k *= m;
+         k ^= k >> 47;
+         k *= m;
+         h ^= k;
+         h *= m;
       }
-      else
+
+      if (size)
       {
-         // Crappy way of doing this.
-         reset();
-         for (unsigned i = 0; i < count; i++)
-            step();
+         for (size_t i = size; i; i--)
+            h ^= uint64_t(data[i - 1]) << (8 * (i - 1));
+         h *= m;
       }
+
+      h ^= h >> 47;
+      h *= m;
+      h ^= h >> 47;
+      return h;
+   }
+
+   // Layout of the event cache. Everything is in native byte order, and the magic doubles as an endian check.
+   // The two 16-bit columns together keep the checkpoints 4-byte aligned.
+   // CacheHeader
+   // TempoMap::Change[num_tempo_changes]
+   // uint64_t count
+   // uint32_t tick_deltas[count], uint16_t packed[count], uint16_t tracks[count],
+   // uint32_t checkpoints[num_checkpoints(count)]
+   // uint64_t num_curves
+   // For each curve: CacheCurve, ControlCurve::Checkpoint[num_checkpoints], uint8_t data[data_size]
+   struct CacheHeader
+   {
+      uint32_t magic;
+      uint32_t version;
+      uint64_t hash;
+      uint32_t units_per_beat;
+      uint32_t num_tracks;
+      uint32_t num_tempo_changes;
+      uint32_t padding;
+   };
+   struct CacheCurve
+   {
+      uint32_t channel;
+      uint32_t control;
+      uint64_t num_checkpoints;
+      uint64_t data_size;
+   };
+   static const uint32_t cache_magic = 0x4d56495au; // MVIZ
+   static const uint32_t cache_version = 6;
+
+   void File::load(const uint8_t *data, size_t size, const char *cache_dir)
+   {
+      string cache_path;
+      uint64_t hash = 0;
+
+      if (cache_dir && *cache_dir)
+      {
+         hash = hash_data(data, size);
+
+         char name[64];
+         snprintf(name, sizeof(name), "midiviz-%016llx.cache", (unsigned long long)hash);
+         cache_path = cache_dir;
+         if (cache_path.back() != '/' && cache_path.back() != '\\')
+            cache_path += '/';
+         cache_path += name;
+
+         if (load_cache(cache_path, hash))
+         {
+            reset();
+            return;
+         }
+      }
+
+      parse(data, size);
+
+      if (!cache_path.empty())
+         save_cache(cache_path, hash);
+   }
+
+   bool File::load_cache(const string &path, uint64_t hash)
+   {
+      shared_ptr<MappedFile> file;
+      try
+      {
+         file = make_shared<MappedFile>(path.c_str());
+      }
+      catch (const exception &)
+      {
+         return false;
+      }
+
+      const uint8_t *data = file->data();
+      size_t size = file->size();
+
+      CacheHeader header;
+      if (size < sizeof(header))
+         return false;
+      memcpy(&header, data, sizeof(header));
+
+      // MThd stores the track count in 16 bits, so a larger one can only come from a damaged cache.
+      if (header.magic != cache_magic || header.version != cache_version ||
+          header.hash != hash || !header.units_per_beat || header.num_tracks > 0xffffu)
+         return false;
+
+      size_t offset = sizeof(header);
+      size_t tempo_size = header.num_tempo_changes * sizeof(TempoMap::Change);
+      if (size - offset < tempo_size + sizeof(uint64_t))
+         return false;
+
+      vector<TempoMap::Change> changes(header.num_tempo_changes);
+      if (tempo_size)
+         memcpy(changes.data(), data + offset, tempo_size);
+      offset += tempo_size;
+
+      uint64_t count;
+      memcpy(&count, data + offset, sizeof(count));
+      offset += sizeof(count);
+
+      if (count > (size - offset) / (sizeof(uint32_t) + 2 * sizeof(uint16_t)))
+         return false;
+
+      Timeline mapped;
+      mapped.count = size_t(count);
+      mapped.tick_deltas = reinterpret_cast<const uint32_t *>(data + offset);
+      offset += mapped.count * sizeof(uint32_t);
+      mapped.packed = reinterpret_cast<const uint16_t *>(data + offset);
+      offset += mapped.count * sizeof(uint16_t);
+      mapped.tracks = reinterpret_cast<const uint16_t *>(data + offset);
+      offset += mapped.count * sizeof(uint16_t);
+      mapped.checkpoints = reinterpret_cast<const uint32_t *>(data + offset);
+      offset += num_checkpoints(mapped.count) * sizeof(uint32_t);
+      if (offset > size || size - offset < sizeof(uint64_t))
+         return false;
+
+      // Curves are small, so they are copied out rather than mapped.
+      uint64_t num_curves;
+      memcpy(&num_curves, data + offset, sizeof(num_curves));
+      offset += sizeof(num_curves);
+      if (num_curves > 16 * NumControls)
+         return false;
+
+      vector<ControlCurve> mapped_curves(num_curves);
+      for (auto &curve : mapped_curves)
+      {
+         CacheCurve info;
+         if (size - offset < sizeof(info))
+            return false;
+         memcpy(&info, data + offset, sizeof(info));
+         offset += sizeof(info);
+
+         if (info.channel >= 16 || info.control >= NumControls ||
+             info.num_checkpoints > (size - offset) / sizeof(ControlCurve::Checkpoint))
+            return false;
+
+         vector<ControlCurve::Checkpoint> checkpoints(info.num_checkpoints);
+         size_t checkpoints_size = checkpoints.size() * sizeof(ControlCurve::Checkpoint);
+         if (checkpoints_size)
+            memcpy(checkpoints.data(), data + offset, checkpoints_size);
+         offset += checkpoints_size;
+
+         if (info.data_size > size - offset)
+            return false;
+         vector<uint8_t> curve_data(data + offset, data + offset + info.data_size);
+         offset += info.data_size;
+
+         curve.assign(info.channel, info.control, move(curve_data), move(checkpoints));
+      }
+
+      units_per_beat = header.units_per_beat;
+      tempo.build(units_per_beat, move(changes));
+      timeline = move(mapped);
+      num_tracks = header.num_tracks;
+      cache = move(file);
+      build_note_index();
+      curves = move(mapped_curves);
+      build_curve_index();
+
+      fprintf(stderr, "Mapped MIDI event cache \"%s\".\n", path.c_str());
+      return true;
+   }
+
+   void File::save_cache(const string &path, uint64_t hash) const
+   {
+      // Write to a temporary and rename it into place, so a concurrent load never sees a partial cache.
+      string tmp_path = path + ".tmp";
+      unique_ptr<FILE, FILEDeleter> file(fopen(tmp_path.c_str(), "wb"));
+      if (!file)
+      {
+         fprintf(stderr, "Failed to create MIDI event cache \"%s\".\n", path.c_str());
+         return;
+      }
+
+      auto &changes = tempo.get_changes();
+
+      CacheHeader header = {};
+      header.magic = cache_magic;
+      header.version = cache_version;
+      header.hash = hash;
+      header.units_per_beat = units_per_beat;
+      header.num_tracks = num_tracks;
+      header.num_tempo_changes = changes.size();
+
+      bool ok = fwrite(&header, sizeof(header), 1, file.get()) == 1;
+      if (ok && !changes.empty())
+         ok = fwrite(changes.data(), sizeof(changes[0]), changes.size(), file.get()) == changes.size();
+
+      uint64_t count = timeline.count;
+      ok = ok && fwrite(&count, sizeof(count), 1, file.get()) == 1;
+
+      if (ok && timeline.count)
+      {
+         ok = fwrite(timeline.tick_deltas, sizeof(uint32_t), timeline.count, file.get()) == timeline.count &&
+              fwrite(timeline.packed, sizeof(uint16_t), timeline.count, file.get()) == timeline.count &&
+              fwrite(timeline.tracks, sizeof(uint16_t), timeline.count, file.get()) == timeline.count;
+
+         size_t checkpoints = num_checkpoints(timeline.count);
+         ok = ok && fwrite(timeline.checkpoints, sizeof(uint32_t), checkpoints, file.get()) == checkpoints;
+      }
+
+      uint64_t num_curves = curves.size();
+      ok = ok && fwrite(&num_curves, sizeof(num_curves), 1, file.get()) == 1;
+      for (auto &curve : curves)
+      {
+         auto &checkpoints = curve.get_checkpoints();
+         auto &data = curve.get_data();
+         CacheCurve info = { curve.get_channel(), curve.get_control(), checkpoints.size(), data.size() };
+
+         ok = ok && fwrite(&info, sizeof(info), 1, file.get()) == 1;
+         if (ok && !checkpoints.empty())
+            ok = fwrite(checkpoints.data(), sizeof(checkpoints[0]), checkpoints.size(), file.get()) == checkpoints.size();
+         if (ok && !data.empty())
+            ok = fwrite(data.data(), 1, data.size(), file.get()) == data.size();
+      }
+
+      ok = fclose(file.release()) == 0 && ok;
+#ifdef _WIN32
+      // rename() does not replace an existing file here.
+      if (ok)
+         remove(path.c_str());
+#endif
+      if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0)
+      {
+         remove(tmp_path.c_str());
+         fprintf(stderr, "Failed to write MIDI event cache \"%s\".\n", path.c_str());
+      }
+   }
+
+   // Streaming state. A worker thread decodes all tracks one block of ticks at a time
+   // and queues the blocks for step(), which only ever holds the block it is playing.
+   // Blocks span a fixed amount of time rather than frames, so they do not depend on fps.
+   struct File::Stream
+   {
+      // One block of the merged timeline, laid out like Timeline.
+      struct Block
+      {
+         vector<uint32_t> tick_deltas;
+         vector<uint16_t> packed;
+         vector<uint16_t> tracks;
+         uint32_t start_tick = 0;
+         uint32_t end_tick = 0;
+         bool last = false;
+         bool discard = false;
+      };
+
+      struct Decoder
+      {
+         TrackDecoder decoder;
+         uint32_t pending_tick = 0;
+         uint16_t pending = 0;
+         bool has_pending = false;
+         bool done = false;
+      };
+
+      Stream(const char *path)
+         : file(path)
+      {
+      }
+
+      ~Stream()
+      {
+         stop();
+      }
+
+      MappedFile file;
+      vector<Chunk> chunks;
+      TempoMap tempo;
+
+      thread worker;
+      mutex lock;
+      condition_variable cond;
+      deque<unique_ptr<Block>> ready;
+      bool shutdown = false;
+
+      unique_ptr<Block> current;
+      vector<unique_ptr<Block>> retired;
+
+      enum { MaxReadyBlocks = 4 };
+
+      void start(uint32_t start_tick);
+      void stop();
+      void run(vector<Decoder> decoders, uint32_t start_tick);
+      void decode_block(vector<Decoder> &decoders, Block &block);
+      unique_ptr<Block> pop();
+   };
+
+   void File::Stream::start(uint32_t start_tick)
+   {
+      vector<Decoder> decoders(chunks.size());
+      for (size_t i = 0; i < chunks.size(); i++)
+         decoders[i].decoder = TrackDecoder(chunks[i].data, chunks[i].size);
+
+      shutdown = false;
+      worker = thread(&Stream::run, this, move(decoders), start_tick);
+   }
+
+   void File::Stream::stop()
+   {
+      {
+         lock_guard<mutex> holder{lock};
+         shutdown = true;
+      }
+      cond.notify_all();
+
+      if (worker.joinable())
+         worker.join();
+      ready.clear();
+      current.reset();
+      retired.clear();
+   }
+
+   void File::Stream::decode_block(vector<Decoder> &decoders, Block &block)
+   {
+      vector<vector<uint32_t>> tick_deltas(decoders.size());
+      vector<vector<uint16_t>> packed(decoders.size());
+      block.last = true;
+
+      for (size_t i = 0; i < decoders.size(); i++)
+      {
+         auto &d = decoders[i];
+
+         // The first delta of every block is relative to the start of the block.
+         uint32_t last = block.start_tick;
+         while (!d.done)
+         {
+            if (!d.has_pending)
+            {
+               auto e = d.decoder.next();
+               if (e.type == TrackDecoder::Type::End)
+               {
+                  d.done = true;
+                  break;
+               }
+               else if (e.type != TrackDecoder::Type::Note)
+                  continue;
+
+               d.pending_tick = e.tick;
+               d.pending = e.packed;
+               d.has_pending = true;
+            }
+
+            if (d.pending_tick >= block.end_tick)
+               break;
+
+            if (!block.discard)
+            {
+               tick_deltas[i].push_back(d.pending_tick - last);
+               packed[i].push_back(d.pending);
+            }
+            last = d.pending_tick;
+            d.has_pending = false;
+         }
+
+         if (!d.done)
+            block.last = false;
+      }
+
+      if (!block.discard)
+         merge_tracks(tick_deltas, packed, block.tick_deltas, block.packed, block.tracks);
+   }
+
+   void File::Stream::run(vector<Decoder> decoders, uint32_t start_tick)
+   {
+      uint32_t end_tick = start_tick;
+      double end_seconds = tempo.tick_to_seconds(start_tick);
+      bool last = false;
+
+      // Starting mid-song, everything before the start tick is decoded and thrown away.
+      if (start_tick)
+      {
+         Block skipped;
+         skipped.end_tick = start_tick;
+         skipped.discard = true;
+         try
+         {
+            decode_block(decoders, skipped);
+         }
+         catch (const exception &e)
+         {
+            fprintf(stderr, "Failed to stream MIDI file: %s\n", e.what());
+            for (auto &d : decoders)
+               d.done = true;
+         }
+      }
+
+      while (!last)
+      {
+         {
+            unique_lock<mutex> holder{lock};
+            cond.wait(holder, [this]() {
+               return shutdown || ready.size() < MaxReadyBlocks;
+            });
+            if (shutdown)
+               return;
+         }
+
+         unique_ptr<Block> block(new Block);
+         block->start_tick = end_tick;
+         end_seconds += StreamBlockSeconds;
+         double next_end = ceil(tempo.seconds_to_tick(end_seconds));
+         end_tick = next_end >= double(UINT32_MAX) ? UINT32_MAX : max(uint32_t(next_end), end_tick + 1);
+         block->end_tick = end_tick;
+
+         try
+         {
+            decode_block(decoders, *block);
+         }
+         catch (const exception &e)
+         {
+            // Play what we have, then end the song.
+            fprintf(stderr, "Failed to stream MIDI file: %s\n", e.what());
+            block->last = true;
+         }
+         last = block->last;
+
+         {
+            lock_guard<mutex> holder{lock};
+            ready.push_back(move(block));
+         }
+         cond.notify_all();
+      }
+   }
+
+   unique_ptr<File::Stream::Block> File::Stream::pop()
+   {
+      unique_lock<mutex> holder{lock};
+      cond.wait(holder, [this]() {
+         return !ready.empty();
+      });
+
+      auto block = move(ready.front());
+      ready.pop_front();
+      holder.unlock();
+      cond.notify_all();
+      return block;
+   }
+
+   File File::open_streaming(double fps, const char *path)
+   {
+      File file;
+      file.fps = fps;
+      file.stream.reset(new Stream(path));
+
+      auto &stream = *file.stream;
+      stream.chunks = read_chunks(stream.file.data(), stream.file.size(), file.units_per_beat);
+
+      // Tempo has to be known before any note can be placed in time, so take it from the
+      // conductor track up front. Type 1 files keep their tempo changes there.
+      vector<TempoMap::Change> changes;
+      if (!stream.chunks.empty())
+      {
+         TrackDecoder decoder(stream.chunks[0].data, stream.chunks[0].size);
+         for (auto e = decoder.next(); e.type != TrackDecoder::Type::End; e = decoder.next())
+            if (e.type == TrackDecoder::Type::Tempo)
+               changes.push_back({ e.tick, e.usec_per_beat });
+      }
+      file.tempo.build(file.units_per_beat, move(changes));
+      stream.tempo = file.tempo;
+
+      file.num_tracks = stream.chunks.size();
+      file.held_notes.assign(size_t(file.num_tracks) * 128, Note());
+      file.held_keys.assign(size_t(file.num_tracks) * 2, 0);
+      file.reset();
+
+      fprintf(stderr, "Streaming MIDI file \"%s\" (%u tracks).\n", path, unsigned(stream.chunks.size()));
+      return file;
+   }
+
+   void File::next_block()
+   {
+      auto &block = stream->current;
+      block = stream->pop();
+
+      timeline.tick_deltas = block->tick_deltas.data();
+      timeline.packed = block->packed.data();
+      timeline.tracks = block->tracks.data();
+      timeline.count = block->packed.size();
+      events_ptr = 0;
+      next_tick = block->start_tick + (timeline.count ? timeline.tick_deltas[0] : 0);
+      next_frame = tick_to_frame(next_tick);
+   }
+
+   void File::build_checkpoints(Timeline &timeline)
+   {
+      auto &checkpoints = timeline.storage->checkpoints;
+      checkpoints.resize(num_checkpoints(timeline.count));
+
+      uint32_t tick = 0;
+      for (size_t i = 0; i < timeline.count; i++)
+      {
+         tick += timeline.tick_deltas[i];
+         if (i % CheckpointStride == 0)
+            checkpoints[i / CheckpointStride] = tick;
+      }
+
+      timeline.checkpoints = checkpoints.data();
+   }
+
+   File File::share() const
+   {
+      if (stream)
+         throw runtime_error("A streaming MIDI file cannot be shared.");
+
+      File file;
+      file.timeline = timeline;
+      file.note_index = note_index;
+      // Curves keep a cursor of their own, but they are small.
+      file.curves = curves;
+      file.curve_index = curve_index;
+      file.num_tracks = num_tracks;
+      file.units_per_beat = units_per_beat;
+      file.tempo = tempo;
+      file.fps = fps;
+      file.cache = cache;
+      file.reset();
+      return file;
+   }
+
+   File::File() = default;
+   File::File(File &&) = default;
+   File &File::operator=(File &&) = default;
+   File::~File() = default;
+
+   unsigned File::get_num_tracks() const
+   {
+      return num_tracks;
+   }
+
+   void File::reset()
+   {
+      seek(0);
+   }
+
+   void File::step()
+   {
+      step(1);
+   }
+
+   uint32_t File::tick_to_frame(uint32_t tick) const
+   {
+      double frame = round(tempo.tick_to_seconds(tick) * fps);
+      return frame < double(UINT32_MAX) ? uint32_t(frame) : UINT32_MAX;
+   }
+
+   uint32_t File::first_tick_after(unsigned frame) const
+   {
+      if (tempo.empty())
+         return 0;
+
+      // Ticks round to the nearest frame, so the boundary sits half a frame in.
+      // The estimate can be off by one either way from rounding, which the loops fix up.
+      double estimate = ceil(tempo.seconds_to_tick((double(frame) + 0.5) / fps));
+      uint32_t tick = estimate <= 0.0 ? 0 : estimate >= double(UINT32_MAX) ? UINT32_MAX : uint32_t(estimate);
+      while (tick > 0 && tick_to_frame(tick - 1) > frame)
+         tick--;
+      while (tick < UINT32_MAX && tick_to_frame(tick) <= frame)
+         tick++;
+      return tick;
+   }
+
+   void File::join_last_groups()
+   {
+      unique_ptr<Stream::Block> joined(new Stream::Block);
+      for (size_t group = stepped.size() - 2; group < stepped.size(); group++)
+      {
+         auto &events = stepped[group];
+         for (size_t i = 0; i < events.size(); i++)
+         {
+            auto e = events[i];
+            joined->packed.push_back(pack_event(e.kon, e.note, e.velocity));
+            joined->tracks.push_back(uint16_t(events.get_track(i)));
+         }
+      }
+
+      uint32_t event_frame = stepped.back().get_frame();
+      stepped.pop_back();
+      stepped.back() = { joined->packed.data(), joined->tracks.data(), joined->packed.size(), event_frame };
+      stream->retired.push_back(move(joined));
+   }
+
+   void File::set_fps(double new_fps)
+   {
+      frame = unsigned(round(double(frame) * new_fps / fps));
+      fps = new_fps;
+      next_frame = tick_to_frame(next_tick);
+      stepped.clear();
+   }
+
+   const vector<FrameEvents> &File::step(unsigned count)
+   {
+      unsigned end = frame + count;
+      stepped.clear();
+      if (stream)
+         stream->retired.clear();
+
+      // Everything before this tick plays before the frame at end.
+      uint32_t limit = count ? first_tick_after(end - 1) : 0;
+
+      // Notes released before the first frame stepped here can no longer be asked for.
+      if (stream && count && frame)
+         prune_held_notes(first_tick_after(frame - 1));
+
+      for (;;)
+      {
+         // Only the tick column is touched here. Events are unpacked when they are iterated.
+         while (events_ptr < timeline.count && next_tick < limit)
+         {
+            size_t begin = events_ptr;
+            uint32_t event_frame = next_frame;
+            while (events_ptr < timeline.count && next_frame == event_frame)
+            {
+               if (stream)
+                  update_held_notes(timeline.tracks[events_ptr], timeline.packed[events_ptr], next_tick);
+
+               if (++events_ptr < timeline.count)
+               {
+                  next_tick += timeline.tick_deltas[events_ptr];
+                  next_frame = tick_to_frame(next_tick);
+               }
+            }
+
+            stepped.push_back({ timeline.packed + begin, timeline.tracks + begin, events_ptr - begin, event_frame });
+
+            // A block boundary can cut a frame in two. Join the halves so every frame has one group.
+            if (stream && stepped.size() > 1 && stepped[stepped.size() - 2].get_frame() == event_frame)
+               join_last_groups();
+         }
+
+         if (!stream || stream->current->last || limit <= stream->current->end_tick)
+            break;
+
+         // Blocks stepped past stay alive until the next step, since the result may point into them.
+         stream->retired.push_back(move(stream->current));
+         next_block();
+      }
+
+      bool last_frame_empty = stepped.empty() || stepped.back().get_frame() + 1 < end;
+      is_eof = last_frame_empty && events_ptr >= timeline.count && (!stream || stream->current->last);
+      frame = end;
+      return stepped;
+   }
+
+   void File::build_note_index()
+   {
+      // Pair every note-on with the next note-off or note-on of the same key on the same track.
+      vector<vector<Note>> notes(num_tracks);
+      vector<size_t> open(size_t(num_tracks) * 128, SIZE_MAX);
+
+      uint32_t tick = 0;
+      for (size_t i = 0; i < timeline.count; i++)
+      {
+         tick += timeline.tick_deltas[i];
+         unsigned track = timeline.tracks[i];
+         if (track >= num_tracks)
+            continue;
+
+         auto e = unpack_event(timeline.packed[i], tick);
+         auto &slot = open[track * 128 + e.note];
+         if (slot != SIZE_MAX)
+         {
+            notes[track][slot].end = tick;
+            slot = SIZE_MAX;
+         }
+
+         if (e.kon && e.velocity)
+         {
+            slot = notes[track].size();
+            notes[track].push_back({ tick, UINT32_MAX, e.note, e.velocity });
+         }
+      }
+
+      auto index = make_shared<vector<NoteIndex>>(num_tracks);
+      parallel_for(num_tracks, [&](unsigned i) {
+         (*index)[i].build(move(notes[i]));
+      });
+      note_index = move(index);
+   }
+
+   void File::update_held_notes(unsigned track, uint16_t packed, uint32_t tick)
+   {
+      if (track >= num_tracks)
+         return;
+
+      auto e = unpack_event(packed, tick);
+      auto &held = held_notes[track * 128 + e.note];
+      if (held.end == UINT32_MAX)
+         held.end = tick;
+      if (e.kon && e.velocity)
+      {
+         held = { tick, UINT32_MAX, e.note, e.velocity };
+         uint64_t *keys = &held_keys[track * 2];
+         if (!keys[0] && !keys[1])
+            held_tracks.push_back(track);
+         keys[e.note >> 6] |= uint64_t(1) << (e.note & 63);
+      }
+   }
+
+   void File::prune_held_notes(uint32_t tick)
+   {
+      for (size_t i = 0; i < held_tracks.size(); )
+      {
+         unsigned track = held_tracks[i];
+         for (unsigned word = track * 2; word < track * 2 + 2; word++)
+         {
+            for (uint64_t keys = held_keys[word]; keys; keys &= keys - 1)
+            {
+               unsigned bit = __builtin_ctzll(keys);
+               if (held_notes[word * 64 + bit].end <= tick)
+                  held_keys[word] &= ~(uint64_t(1) << bit);
+            }
+         }
+
+         if (!held_keys[track * 2] && !held_keys[track * 2 + 1])
+         {
+            held_tracks[i] = held_tracks.back();
+            held_tracks.pop_back();
+         }
+         else
+            i++;
+      }
+   }
+
+   void File::append_notes_as_frames(vector<Note> &notes, size_t first) const
+   {
+      for (size_t i = first; i < notes.size(); i++)
+      {
+         notes[i].start = tick_to_frame(notes[i].start);
+         if (notes[i].end != UINT32_MAX)
+            notes[i].end = tick_to_frame(notes[i].end);
+      }
+   }
+
+   void File::get_active_notes(unsigned track, unsigned frame, vector<Note> &notes) const
+   {
+      // A note is held on a frame if it starts before the frame ends and ends after that.
+      uint32_t bound = first_tick_after(frame);
+      if (track >= num_tracks || !bound)
+         return;
+
+      uint32_t tick = bound - 1;
+      size_t first = notes.size();
+      if (stream)
+      {
+         for (unsigned word = 0; word < 2; word++)
+         {
+            for (uint64_t keys = held_keys[track * 2 + word]; keys; keys &= keys - 1)
+            {
+               auto &held = held_notes[track * 128 + word * 64 + __builtin_ctzll(keys)];
+               if (held.start <= tick && tick < held.end)
+                  notes.push_back(held);
+            }
+         }
+      }
+      else
+         (*note_index)[track].query(tick, notes);
+
+      append_notes_as_frames(notes, first);
+   }
+
+   void File::build_curve_index()
+   {
+      curve_index.assign(16 * NumControls, -1);
+      for (size_t i = 0; i < curves.size(); i++)
+         curve_index[curves[i].get_channel() * NumControls + curves[i].get_control()] = int(i);
+   }
+
+   float File::get_control(unsigned channel, unsigned control, unsigned frame, float def)
+   {
+      if (channel >= 16 || control >= NumControls || curve_index.empty())
+         return def;
+
+      int index = curve_index[channel * NumControls + control];
+      if (index < 0)
+         return def;
+
+      uint32_t bound = first_tick_after(frame);
+      int value = bound ? curves[index].sample(bound - 1) : -1;
+      if (value < 0)
+         return def;
+      else if (control == ControlPitchBend)
+         return float(value - 8192) * (1.0f / 8192.0f);
+      else
+         return float(value) * (1.0f / 127.0f);
+   }
+
+   double File::get_beat() const
+   {
+      return tempo.frame_to_beat(frame, fps);
+   }
+
+   double File::get_beat(unsigned frame) const
+   {
+      return tempo.frame_to_beat(frame, fps);
+   }
+
+   void File::seek(unsigned count)
+   {
+      frame = count;
+      stepped.clear();
+
+      // The first event to play is the first one on or after this tick.
+      uint32_t target = count ? first_tick_after(count - 1) : 0;
+
+      if (stream)
+      {
+         stream->stop();
+         stream->start(target);
+         next_block();
+         fill(begin(held_notes), end(held_notes), Note());
+         fill(begin(held_keys), end(held_keys), 0);
+         held_tracks.clear();
+         is_eof = false;
+         return;
+      }
+
+      events_ptr = 0;
+      next_tick = 0;
+      next_frame = 0;
+      is_eof = !timeline.count;
+      if (!timeline.count)
+         return;
+
+      // Find the last checkpoint before the target, then walk at most one stride of deltas
+      // to the first event that is still due.
+      size_t index = 0;
+      uint32_t tick_at = timeline.tick_deltas[0];
+
+      auto *checkpoints = timeline.checkpoints;
+      auto *checkpoints_end = checkpoints + num_checkpoints(timeline.count);
+      size_t before = lower_bound(checkpoints, checkpoints_end, target) - checkpoints;
+      if (before)
+      {
+         index = (before - 1) * CheckpointStride;
+         tick_at = checkpoints[before - 1];
+      }
+
+      while (tick_at < target && ++index < timeline.count)
+         tick_at += timeline.tick_deltas[index];
+
+      events_ptr = index;
+      next_tick = tick_at;
+      next_frame = tick_to_frame(tick_at);
+      is_eof = index >= timeline.count;
+   }
+
+   EventRange File::get_events(unsigned track) const
+   {
+      if (stepped.empty() || stepped.back().get_frame() + 1 != frame)
+         return {};
+      return stepped.back().get_events(track);
    }
 
-   const vector<Event> &File::get_events(unsigned track) const
+   EventRange FrameEvents::get_events(unsigned track) const
    {
-      return tracks[track].current_events;
+      if (track > 0xffffu)
+         return {};
+      return { packed, tracks, count, uint16_t(track), frame };
    }
 }
@@ -2,6 +2,8 @@
 #define MIDI_HPP__
 
 #include <vector>
+#include <memory>
+#include <string>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -15,36 +17,394 @@ namespace MIDI
       uint32_t frame;
    };
 
+   // A note from its note-on up to, but not including, its note-off.
+   // The index keeps positions in ticks, File hands them out in frames.
+   // Notes that are never released end at UINT32_MAX.
+   struct Note
+   {
+      uint32_t start;
+      uint32_t end;
+      uint8_t note;
+      uint8_t velocity;
+   };
+
+   // Static interval index over the notes of one track.
+   // Notes are sorted by start and laid out as an implicit binary tree where every node also
+   // knows the latest end in its subtree, so a query costs O(log n + k) for k results.
+   class NoteIndex
+   {
+      public:
+         // Notes must already be sorted by start.
+         void build(std::vector<Note> notes);
+
+         // Appends every note with start <= tick < end.
+         void query(uint32_t tick, std::vector<Note> &result) const;
+
+         size_t size() const { return notes.size(); }
+
+      private:
+         std::vector<Note> notes;
+         std::vector<uint32_t> max_end;
+         int max_level = -1;
+   };
+
+   // Continuous controllers. Control numbers 0-127 are MIDI CCs, the rest are channel-wide
+   // messages which are not CCs in the file but behave like one.
+   enum Control
+   {
+      ControlModulation = 1,
+      ControlCutoff = 74,
+      ControlPitchBend = 128,
+      ControlPressure = 129,
+      NumControls = 130
+   };
+
+   // Value of one control on one channel over time. Every keyframe holds until the next one.
+   // Keyframes are stored as a varint tick delta and a zigzag varint value delta,
+   // usually two bytes each for dense automation, with a checkpoint every CheckpointStride
+   // keyframes so a jump back only decodes a few of them.
+   class ControlCurve
+   {
+      public:
+         struct Keyframe
+         {
+            uint32_t tick;
+            uint16_t value;
+         };
+
+         struct Checkpoint
+         {
+            uint32_t tick;
+            uint32_t offset;
+            uint32_t value;
+         };
+
+         // Keyframes must be sorted by tick, with at most one per tick.
+         void build(unsigned channel, unsigned control, const std::vector<Keyframe> &keyframes);
+         void assign(unsigned channel, unsigned control, std::vector<uint8_t> data, std::vector<Checkpoint> checkpoints);
+
+         // Value at tick, or -1 before the first keyframe.
+         // Keeps a cursor, so sampling ticks in increasing order costs O(1) amortized.
+         int sample(uint32_t tick);
+
+         unsigned get_channel() const { return channel; }
+         unsigned get_control() const { return control; }
+         const std::vector<uint8_t> &get_data() const { return data; }
+         const std::vector<Checkpoint> &get_checkpoints() const { return checkpoints; }
+
+         enum { CheckpointStride = 64 };
+
+      private:
+         std::vector<uint8_t> data;
+         std::vector<Checkpoint> checkpoints;
+         unsigned channel = 0;
+         unsigned control = 0;
+
+         size_t offset = 0;
+         uint32_t tick = 0;
+         int value = -1;
+   };
+
+   // Note events are stored as 16 bits: kon in bit 15, note in bits 8-14 and velocity in bits 0-6.
+   static inline uint16_t pack_event(bool kon, uint8_t note, uint8_t velocity)
+   {
+      return uint16_t((kon ? 0x8000u : 0u) | ((note & 0x7fu) << 8) | (velocity & 0x7fu));
+   }
+
+   static inline Event unpack_event(uint16_t packed, uint32_t frame)
+   {
+      return { (packed & 0x8000u) != 0, uint8_t((packed >> 8) & 0x7f), uint8_t(packed & 0x7f), frame };
+   }
+
+   // Events of one track on one frame, viewed in place in the packed timeline.
+   // The timeline is ordered by tick, so the track's events are interleaved with those of other
+   // tracks on the same frame. Iterating skips over those and unpacks one event at a time,
+   // so nothing is copied or allocated.
+   // A range is only valid until the next step() or seek() on the File it came from.
+   class EventRange
+   {
+      public:
+         class Iterator
+         {
+            public:
+               Iterator(const uint16_t *packed, const uint16_t *tracks, const uint16_t *end, uint16_t track, uint32_t frame)
+                  : packed(packed), tracks(tracks), end(end), track(track), frame(frame)
+               {
+                  skip();
+               }
+
+               const Event &operator*() const
+               {
+                  event = unpack_event(*packed, frame);
+                  return event;
+               }
+
+               const Event *operator->() const
+               {
+                  return &**this;
+               }
+
+               Iterator &operator++()
+               {
+                  packed++;
+                  tracks++;
+                  skip();
+                  return *this;
+               }
+
+               bool operator==(const Iterator &other) const { return tracks == other.tracks; }
+               bool operator!=(const Iterator &other) const { return tracks != other.tracks; }
+
+            private:
+               const uint16_t *packed;
+               const uint16_t *tracks;
+               const uint16_t *end;
+               uint16_t track;
+               uint32_t frame;
+               mutable Event event;
+
+               void skip()
+               {
+                  while (tracks != end && *tracks != track)
+                  {
+                     packed++;
+                     tracks++;
+                  }
+               }
+         };
+
+         EventRange() = default;
+         EventRange(const uint16_t *packed, const uint16_t *tracks, size_t count, uint16_t track, uint32_t frame)
+            : packed(packed), tracks(tracks), count(count), track(track), frame(frame)
+         {
+         }
+
+         Iterator begin() const { return { packed, tracks, tracks + count, track, frame }; }
+         Iterator end() const { return { packed + count, tracks + count, tracks + count, track, frame }; }
+         bool empty() const { return begin() == end(); }
+
+      private:
+         const uint16_t *packed = nullptr;
+         const uint16_t *tracks = nullptr;
+         size_t count = 0;
+         uint16_t track = 0;
+         uint32_t frame = 0;
+   };
+
+   // All events of one frame. Like EventRange, this is a view into the timeline.
+   class FrameEvents
+   {
+      public:
+         FrameEvents() = default;
+         FrameEvents(const uint16_t *packed, const uint16_t *tracks, size_t count, uint32_t frame)
+            : packed(packed), tracks(tracks), count(count), frame(frame)
+         {
+         }
+
+         EventRange get_events(unsigned track) const;
+         uint32_t get_frame() const { return frame; }
+         size_t size() const { return count; }
+         Event operator[](size_t index) const { return unpack_event(packed[index], frame); }
+         unsigned get_track(size_t index) const { return tracks[index]; }
+
+      private:
+         const uint16_t *packed = nullptr;
+         const uint16_t *tracks = nullptr;
+         size_t count = 0;
+         uint32_t frame = 0;
+   };
+
+   class MappedFile;
+
+   // Piecewise-linear tempo map. Each segment covers the ticks between two Set Tempo events,
+   // so every conversion is a binary search followed by one multiply-add.
+   class TempoMap
+   {
+      public:
+         struct Change
+         {
+            uint32_t tick;
+            uint32_t usec_per_beat;
+         };
+
+         // Changes do not need to be sorted. Until the first change the SMF default of 120 BPM applies.
+         void build(unsigned units_per_beat, std::vector<Change> changes);
+
+         double tick_to_seconds(uint32_t tick) const;
+         double seconds_to_tick(double seconds) const;
+         double seconds_to_beat(double seconds) const
+         {
+            return seconds_to_tick(seconds) / units_per_beat;
+         }
+         double frame_to_beat(double frame, double fps) const
+         {
+            return seconds_to_beat(frame / fps);
+         }
+
+         const std::vector<Change> &get_changes() const { return changes; }
+         bool empty() const { return segments.empty(); }
+
+      private:
+         struct Segment
+         {
+            uint32_t tick;
+            double seconds;
+            double seconds_per_tick;
+         };
+         std::vector<Segment> segments;
+         std::vector<Change> changes;
+         unsigned units_per_beat = 1;
+   };
+
    class File
    {
       public:
-         File(double fps, const char *path);
-         File() = default;
+         // The timeline is kept in ticks and only converted to frames at the cursor, so fps can be
+         // changed at any time with set_fps().
+         // If cache_dir is set, the parsed timeline is cached there keyed by the file contents,
+         // and later loads of the same file map the cache instead of parsing.
+         File(double fps, const char *path, const char *cache_dir = nullptr);
+
+         // Parses directly out of a caller-owned buffer, which only needs to stay
+         // alive for the duration of the constructor.
+         File(double fps, const void *data, size_t size, const char *cache_dir = nullptr);
+         File();
+         ~File();
+
+         // Streaming mode for very large files. Instead of parsing everything up front, a background
+         // thread keeps a short window of events ahead of the playback cursor decoded,
+         // so the first frame is ready almost immediately and memory use stays bounded.
+         // Tempo changes are taken from the first (conductor) track only.
+         static File open_streaming(double fps, const char *path);
+
+         // Another cursor over the same song, starting from the beginning. It shares the parsed
+         // timeline and note index rather than copying them, so it costs little even for huge songs,
+         // and the two can be used from different threads. Not available when streaming.
+         File share() const;
+
+         File(File &&);
+         File &operator=(File &&);
+         File(const File &) = delete;
+         void operator=(const File &) = delete;
 
          unsigned get_num_tracks() const;
+         unsigned get_frame() const { return frame; }
+
+         // Changes the frame rate without reparsing. The cursor stays at the same point in time.
+         void set_fps(double fps);
+         double get_fps() const { return fps; }
          void step();
+
+         // Steps over count frames in one pass over the timeline.
+         // Returns the frames that had events, in order. Frames without events are left out.
+         // The result stays valid until the next step() or seek().
+         const std::vector<FrameEvents> &step(unsigned count);
          void reset();
          bool eof() const { return is_eof; }
 
-         const std::vector<Event> &get_events(unsigned track) const;
+         EventRange get_events(unsigned track) const;
          double get_beat() const;
+         double get_beat(unsigned frame) const;
+
+         // Appends the notes of a track that are held at the given frame.
+         // When streaming, only the last note of every key up to the cursor is known,
+         // and notes held across a seek are lost.
+         void get_active_notes(unsigned track, unsigned frame, std::vector<Note> &notes) const;
+
+         // Control value of a channel at the given frame, normalized to [0, 1], or [-1, 1] for pitch bend.
+         // Returns def if the song does not set the control by then. Controls are not decoded when streaming.
+         float get_control(unsigned channel, unsigned control, unsigned frame, float def = 0.0f);
          void seek(unsigned tick);
 
       private:
-         struct Track
+         // All note events of every track, merged into one timeline ordered by tick and then by track.
+         // Events are stored as columns rather than an Event array: the tick distance to the previous
+         // event, the note packed into 16 bits, and the track the event came from.
+         // The columns point into the storage vectors below, into the mapped cache,
+         // or into the block currently being streamed.
+         struct Timeline
          {
-            std::vector<Event> current_events;
-            std::vector<Event> all_events;
-            unsigned events_ptr = 0;
+            const uint32_t *tick_deltas = nullptr;
+            const uint16_t *packed = nullptr;
+            const uint16_t *tracks = nullptr;
+            size_t count = 0;
+
+            // Absolute tick of every CheckpointStride-th event, so seek() can binary search
+            // without giving up delta encoding. Not used when streaming.
+            const uint32_t *checkpoints = nullptr;
+
+            // Owns the columns when they are not mapped. Never changed once built,
+            // so the cursors made by share() hold on to it instead of copying.
+            struct Storage
+            {
+               std::vector<uint32_t> ticks;
+               std::vector<uint16_t> packed;
+               std::vector<uint16_t> tracks;
+               std::vector<uint32_t> checkpoints;
+            };
+            std::shared_ptr<Storage> storage;
          };
-         std::vector<Track> tracks;
+         Timeline timeline;
+         size_t events_ptr = 0;
+         uint32_t next_tick = 0;
+         uint32_t next_frame = 0;
+
+         // Frame an event at the given tick plays on at the current rate.
+         uint32_t tick_to_frame(uint32_t tick) const;
+         // First tick that plays after the given frame.
+         uint32_t first_tick_after(unsigned frame) const;
+
+         // The frames the last step() went over, grouped by frame.
+         std::vector<FrameEvents> stepped;
+
+         // Note-on/note-off pairs of every track, built from the timeline after loading.
+         std::shared_ptr<const std::vector<NoteIndex>> note_index;
+         void build_note_index();
+
+         // Controller curves of every channel, and the index of each channel and control's curve, or -1.
+         std::vector<ControlCurve> curves;
+         std::vector<int> curve_index;
+         void build_curve_index();
+
+         // Streaming has no complete timeline, so step() keeps the last note of every track and key instead.
+         std::vector<Note> held_notes;
+         // Two words per track with a bit for every key whose last note may still be held,
+         // so lookups only visit those keys.
+         std::vector<uint64_t> held_keys;
+         // Tracks with any bit set in held_keys, so pruning skips the silent ones.
+         std::vector<unsigned> held_tracks;
+         void update_held_notes(unsigned track, uint16_t packed, uint32_t tick);
+         // Forgets notes released at or before tick.
+         void prune_held_notes(uint32_t tick);
+         void append_notes_as_frames(std::vector<Note> &notes, size_t first) const;
+
+         unsigned num_tracks = 0;
          unsigned units_per_beat = 0;
-         double time_per_beat = 0.0;
+         TempoMap tempo;
          double fps;
          unsigned frame = 0;
          bool is_eof = false;
 
-         void parse_track(Track &track, const uint8_t *data, size_t size);
+         std::shared_ptr<MappedFile> cache;
+
+         struct Stream;
+         std::unique_ptr<Stream> stream;
+         static constexpr double StreamBlockSeconds = 1.0;
+         void next_block();
+         // Copies the two halves of a frame cut by a block boundary into one group.
+         void join_last_groups();
+
+         enum { CheckpointStride = 64 };
+         static size_t num_checkpoints(size_t count)
+         {
+            return (count + CheckpointStride - 1) / CheckpointStride;
+         }
+         static void build_checkpoints(Timeline &timeline);
+
+         void load(const uint8_t *data, size_t size, const char *cache_dir);
+         void parse(const uint8_t *data, size_t size);
+         bool load_cache(const std::string &path, uint64_t hash);
+         void save_cache(const std::string &path, uint64_t hash) const;
    };
 }
 
@@ -11,7 +11,8 @@ layout(std430, push_constant) uniform Constants
 
 void main()
 {
-   gl_Position = Color.a < 0.025 ? vec4(0.0, 0.0, 0.0, -1.0) : vec4(registers.scale * Position, 0.0, 1.0);
+   // Only live particles are in the draw list.
+   gl_Position = vec4(registers.scale * Position, 0.0, 1.0);
    gl_PointSize = registers.point_scale * Color.a;
    vColor = Color.rgb * clamp(Color.a, 0.0, 1.0);
 }